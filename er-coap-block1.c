@@ -100,28 +100,33 @@ coap_block1_handler(void *request, void *response, uint8_t *target, size_t *len,
     return -1;
   }
 
-  coap_packet_t *packet = (coap_packet_t *)request;
+  uint32_t block1_num = 0;
+  uint8_t block1_more = 0;
+  uint16_t block1_size = 0;
+  uint32_t block1_offset = 0;
+  int has_block1 = coap_get_header_block1(request, &block1_num, &block1_more,
+                                          &block1_size, &block1_offset);
 
-  if(packet->block1_offset + pay_len > max_len) {
+  if(block1_offset + pay_len > max_len) {
     erbium_status_code = REST.status.REQUEST_ENTITY_TOO_LARGE;
     coap_error_message = "Message to big";
     return -1;
   }
 
   if(target && len) {
-    memcpy(target + packet->block1_offset, payload, pay_len);
-    *len = packet->block1_offset + pay_len;
+    memcpy(target + block1_offset, payload, pay_len);
+    *len = block1_offset + pay_len;
   }
 
-  if(IS_OPTION(packet, COAP_OPTION_BLOCK1)) {
+  if(has_block1) {
     PRINTF("Blockwise: block 1 request: Num: %u, More: %u, Size: %u, Offset: %u\n",
-           packet->block1_num,
-           packet->block1_more,
-           packet->block1_size,
-           packet->block1_offset);
+           block1_num,
+           block1_more,
+           block1_size,
+           block1_offset);
 
-    coap_set_header_block1(response, packet->block1_num, packet->block1_more, packet->block1_size);
-    if(packet->block1_more) {
+    coap_set_header_block1(response, block1_num, block1_more, block1_size);
+    if(block1_more) {
       coap_set_status_code(response, CONTINUE_2_31);
       return 1;
     }
@@ -48,11 +48,128 @@
 #define COAP_SERVER_PORT               COAP_DEFAULT_PORT
 #endif
 
-/* The number of concurrent messages that can be stored for retransmission in the transaction layer. */
+/* The number of concurrent messages that can be stored for retransmission in the transaction layer (per worker). */
 #ifndef COAP_MAX_OPEN_TRANSACTIONS
 #define COAP_MAX_OPEN_TRANSACTIONS     4
 #endif /* COAP_MAX_OPEN_TRANSACTIONS */
 
+/* Number of reference-counted notification buffers: a CON notification in flight holds one per observer, plus one per notify in progress */
+#ifndef COAP_MAX_SHARED_BUFFERS
+#define COAP_MAX_SHARED_BUFFERS        (COAP_MAX_OBSERVERS + COAP_ENGINE_WORKERS + 1)
+#endif /* COAP_MAX_SHARED_BUFFERS */
+
+/* Number of pbufs referencing a shared buffer until lwIP frees them; when none is left the notification tail is copied */
+#ifndef COAP_MAX_SHARED_PBUFS
+#define COAP_MAX_SHARED_PBUFS          COAP_MAX_OBSERVERS
+#endif /* COAP_MAX_SHARED_PBUFS */
+
+/* Number of engine tasks; datagrams are sharded by source address and port so each peer is always served by the same worker */
+#ifndef COAP_ENGINE_WORKERS
+#define COAP_ENGINE_WORKERS            1
+#endif /* COAP_ENGINE_WORKERS */
+
+/* Receive queue length of the additional workers (the first one uses the queue passed to coap_init_engine()) */
+#ifndef COAP_WORKER_QUEUE_LENGTH
+#define COAP_WORKER_QUEUE_LENGTH       8
+#endif /* COAP_WORKER_QUEUE_LENGTH */
+
+/* FreeRTOS thread local storage slot for the per-worker context (needs configNUM_THREAD_LOCAL_STORAGE_POINTERS) */
+#ifndef COAP_CONTEXT_TLS_INDEX
+#define COAP_CONTEXT_TLS_INDEX         0
+#endif /* COAP_CONTEXT_TLS_INDEX */
+
+/* Number of queued datagrams the engine parses and handles per wakeup (each takes a coap_packet_t) */
+#ifndef COAP_RECEIVE_BATCH_SIZE
+#define COAP_RECEIVE_BATCH_SIZE        4
+#endif /* COAP_RECEIVE_BATCH_SIZE */
+
+/* Packet buffers for transactions come from three size classes, the largest one holds COAP_MAX_PACKET_SIZE */
+#ifndef COAP_BUFFER_SMALL_SIZE
+#define COAP_BUFFER_SMALL_SIZE         32
+#endif /* COAP_BUFFER_SMALL_SIZE */
+
+#ifndef COAP_BUFFER_MEDIUM_SIZE
+#define COAP_BUFFER_MEDIUM_SIZE        64
+#endif /* COAP_BUFFER_MEDIUM_SIZE */
+
+/* Number of buffers per size class (at least 1 each); transactions take a large one and CONs move to the smallest that fits once sent */
+#ifndef COAP_BUFFER_SMALL_COUNT
+#define COAP_BUFFER_SMALL_COUNT        (COAP_ENGINE_WORKERS * COAP_MAX_OPEN_TRANSACTIONS)
+#endif /* COAP_BUFFER_SMALL_COUNT */
+
+#ifndef COAP_BUFFER_MEDIUM_COUNT
+#define COAP_BUFFER_MEDIUM_COUNT       COAP_ENGINE_WORKERS
+#endif /* COAP_BUFFER_MEDIUM_COUNT */
+
+/* Below COAP_ENGINE_WORKERS * COAP_MAX_OPEN_TRANSACTIONS this becomes the limit for concurrent responses and non-shrunk CONs */
+#ifndef COAP_BUFFER_LARGE_COUNT
+#define COAP_BUFFER_LARGE_COUNT        (COAP_ENGINE_WORKERS * COAP_MAX_OPEN_TRANSACTIONS)
+#endif /* COAP_BUFFER_LARGE_COUNT */
+
+/* Slots of the per-worker open addressing table that finds transactions by MID and endpoint (keep above COAP_MAX_OPEN_TRANSACTIONS) */
+#ifndef COAP_TRANSACTION_TABLE_SIZE
+#define COAP_TRANSACTION_TABLE_SIZE    (2 * COAP_MAX_OPEN_TRANSACTIONS)
+#endif /* COAP_TRANSACTION_TABLE_SIZE */
+
+/* Resolution and size of the per-worker timing wheel that drives retransmissions */
+#ifndef COAP_TIMER_GRANULARITY_MS
+#define COAP_TIMER_GRANULARITY_MS      100
+#endif /* COAP_TIMER_GRANULARITY_MS */
+
+#ifndef COAP_TIMER_WHEEL_SLOTS
+#define COAP_TIMER_WHEEL_SLOTS         32
+#endif /* COAP_TIMER_WHEEL_SLOTS */
+
+/* Responses to recent CON requests kept per engine worker to answer retransmissions, 0 disables the cache */
+#ifndef COAP_DEDUP_CACHE_SIZE
+#define COAP_DEDUP_CACHE_SIZE          4
+#endif /* COAP_DEDUP_CACHE_SIZE */
+
+/* Largest response kept in the duplicate cache, longer ones are recomputed for a retransmitted request */
+#ifndef COAP_DEDUP_RESPONSE_SIZE
+#define COAP_DEDUP_RESPONSE_SIZE       COAP_MAX_PACKET_SIZE
+#endif /* COAP_DEDUP_RESPONSE_SIZE */
+
+/* Derive retransmission timeouts per peer from measured round trips (CoCoA) instead of the fixed COAP_RESPONSE_TIMEOUT */
+#ifndef COAP_ADAPTIVE_RTO
+#define COAP_ADAPTIVE_RTO              1
+#endif /* COAP_ADAPTIVE_RTO */
+
+/* Number of peers per engine worker with RTO state, the least recently measured one is replaced */
+#ifndef COAP_RTO_PEERS
+#define COAP_RTO_PEERS                 4
+#endif /* COAP_RTO_PEERS */
+
+/* Maximum number of CONs outstanding to one peer (NSTART), further ones wait in a FIFO until an ACK arrives */
+#ifndef COAP_NSTART
+#define COAP_NSTART                    1
+#endif /* COAP_NSTART */
+
+/* Number of log2 buckets in the RTT and time-in-pool histograms of er-coap-stats.h, the last one collects everything above 2^(n-2) ms */
+#ifndef COAP_STATS_BUCKETS
+#define COAP_STATS_BUCKETS             16
+#endif /* COAP_STATS_BUCKETS */
+
+/* Register the statistics as a CoAP resource under /stats */
+#ifndef COAP_STATS_RESOURCE
+#define COAP_STATS_RESOURCE            0
+#endif /* COAP_STATS_RESOURCE */
+
+/* Send an empty ACK when a handler for a CON request is still running after COAP_SEPARATE_DEADLINE_MS, its response then goes out as a separate CON */
+#ifndef COAP_AUTO_SEPARATE
+#define COAP_AUTO_SEPARATE             1
+#endif /* COAP_AUTO_SEPARATE */
+
+/* Half of ACK_TIMEOUT, so the ACK arrives before the client retransmits */
+#ifndef COAP_SEPARATE_DEADLINE_MS
+#define COAP_SEPARATE_DEADLINE_MS      (COAP_RESPONSE_TIMEOUT * 500)
+#endif /* COAP_SEPARATE_DEADLINE_MS */
+
+/* Length of tokens from coap_generate_token() used by the client side */
+#ifndef COAP_GENERATED_TOKEN_LEN
+#define COAP_GENERATED_TOKEN_LEN       4
+#endif /* COAP_GENERATED_TOKEN_LEN */
+
 /* Maximum number of failed request attempts before action */
 #ifndef COAP_MAX_ATTEMPTS
 #define COAP_MAX_ATTEMPTS              4
@@ -63,11 +180,40 @@
 #define COAP_MAX_HEADER_SIZE           (4 + COAP_TOKEN_LEN + 3 + 1 + COAP_ETAG_LEN + 4 + 4 + 30)  /* 65 */
 #endif /* COAP_MAX_HEADER_SIZE */
 
-/* Number of observer slots (each takes abot xxx bytes) */
+/* Number of options indexed by the parser and decoded on first access (additional ones are decoded right away) */
+#ifndef COAP_MAX_INDEXED_OPTIONS
+#define COAP_MAX_INDEXED_OPTIONS       8
+#endif /* COAP_MAX_INDEXED_OPTIONS */
+
+/* Expose the whole received payload (also across chained pbufs) through coap_read_payload() instead of truncating it to REST_MAX_CHUNK_SIZE */
+#ifndef COAP_STREAMING_PAYLOAD
+#define COAP_STREAMING_PAYLOAD         0
+#endif /* COAP_STREAMING_PAYLOAD */
+
+/* Number of observer slots; notifications do not take transactions, but each CON notification in flight holds a shared buffer */
 #ifndef COAP_MAX_OBSERVERS
-#define COAP_MAX_OBSERVERS    COAP_MAX_OPEN_TRANSACTIONS - 1
+#define COAP_MAX_OBSERVERS             (2 * COAP_MAX_OPEN_TRANSACTIONS)
 #endif /* COAP_MAX_OBSERVERS */
 
+/* Buckets of the observer index by endpoint, used to remove observers by client, token, or MID */
+#ifndef COAP_OBSERVER_BUCKETS
+#define COAP_OBSERVER_BUCKETS          8
+#endif /* COAP_OBSERVER_BUCKETS */
+
+/* Conditional notifications: observers may register with pmin, pmax, gt, lt, and st query attributes */
+#ifndef COAP_OBSERVE_CONDITIONS
+#define COAP_OBSERVE_CONDITIONS        1
+#endif /* COAP_OBSERVE_CONDITIONS */
+
+/* Stack depth of the engine tasks in words; pmin/pmax notifications run on them with two coap_packet_t and the resource handler */
+#ifndef COAP_ENGINE_STACK_SIZE
+#if COAP_OBSERVE_CONDITIONS
+#define COAP_ENGINE_STACK_SIZE         (256 + 2 * sizeof(coap_packet_t) / sizeof(StackType_t))
+#else
+#define COAP_ENGINE_STACK_SIZE         256
+#endif
+#endif /* COAP_ENGINE_STACK_SIZE */
+
 /* Interval in notifies in which NON notifies are changed to CON notifies to check client. */
 #define COAP_OBSERVE_REFRESH_INTERVAL  20
 
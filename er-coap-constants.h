@@ -45,6 +45,7 @@
 #define COAP_RESPONSE_TIMEOUT                3
 #define COAP_RESPONSE_RANDOM_FACTOR          1.5
 #define COAP_MAX_RETRANSMIT                  4
+#define COAP_EXCHANGE_LIFETIME               247 /* seconds, derived from the transmission parameters above */
 
 #define COAP_HEADER_LEN                      4  /* | version:0x03 type:0x0C tkl:0xF0 | code | mid:0x00FF | mid:0xFF00 | */
 #define COAP_TOKEN_LEN                       8  /* The maximum number of bytes for the Token */
@@ -135,8 +136,14 @@ typedef enum {
   COAP_OPTION_PROXY_URI = 35,   /* 1-1034 B */
   COAP_OPTION_PROXY_SCHEME = 39,        /* 1-255 B */
   COAP_OPTION_SIZE1 = 60,       /* 0-4 B */
+  COAP_OPTION_NO_RESPONSE = 258,        /* 0-1 B, RFC 7967 */
 } coap_option_t;
 
+/* No-Response option value, response classes the client is not interested in */
+#define COAP_NO_RESPONSE_2XX                 0x02
+#define COAP_NO_RESPONSE_4XX                 0x08
+#define COAP_NO_RESPONSE_5XX                 0x10
+
 /* CoAP Content-Formats */
 typedef enum {
   TEXT_PLAIN = 0,
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2017, Department of Computer Engineering, UniPi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ */
+
+/**
+ * \file
+ *      Response cache for duplicate confirmable requests
+ */
+
+#include <string.h>
+#include "er-coap-dedup.h"
+#include "er-coap.h"
+#include "er-coap-timer.h"
+#include "er-coap-stats.h"
+
+#define COAP_DEBUG 0
+#if COAP_DEBUG
+#include <stdio.h>
+#define PRINTF(...) printf(__VA_ARGS__)
+#else
+#define PRINTF(...)
+#endif
+
+#if COAP_DEDUP_CACHE_SIZE > 0
+
+#define COAP_DEDUP_LIFETIME  pdMS_TO_TICKS(COAP_EXCHANGE_LIFETIME * 1000UL)
+
+/*---------------------------------------------------------------------------*/
+typedef struct coap_dedup_entry {
+  ip_addr_t addr;
+  uint16_t port;
+  uint16_t mid;
+  TickType_t expires;
+  uint16_t len;                 /* 0 marks a free entry unless pending */
+  uint8_t pending;              /* request accepted, response not stored yet */
+  uint8_t response[COAP_DEDUP_RESPONSE_SIZE];
+} coap_dedup_entry_t;
+
+/* one cache per engine worker, only touched by the worker owning the shard */
+static coap_dedup_entry_t caches[COAP_ENGINE_WORKERS][COAP_DEDUP_CACHE_SIZE];
+
+/*---------------------------------------------------------------------------*/
+static coap_dedup_entry_t *
+lookup(coap_dedup_entry_t *cache, ip_addr_t *addr, uint16_t port,
+       uint16_t mid, TickType_t now)
+{
+  int i;
+
+  for(i = 0; i < COAP_DEDUP_CACHE_SIZE; ++i) {
+    coap_dedup_entry_t *e = &cache[i];
+
+    if((e->len || e->pending) && COAP_TIMER_BEFORE(e->expires, now)) {
+      e->len = 0;
+      e->pending = 0;
+    }
+    if((e->len || e->pending) && e->mid == mid && e->port == port
+       && ip_addr_cmp(&e->addr, addr)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static coap_dedup_entry_t *
+claim(coap_dedup_entry_t *cache, ip_addr_t *addr, uint16_t port,
+      uint16_t mid, TickType_t now)
+{
+  coap_dedup_entry_t *e;
+  int i;
+
+  if((e = lookup(cache, addr, port, mid, now)) == NULL) {
+    /* take a free entry or evict the one closest to expiry */
+    e = &cache[0];
+    for(i = 0; i < COAP_DEDUP_CACHE_SIZE && (e->len || e->pending); ++i) {
+      if((cache[i].len == 0 && !cache[i].pending)
+         || COAP_TIMER_BEFORE(cache[i].expires, e->expires)) {
+        e = &cache[i];
+      }
+    }
+  }
+  ip_addr_copy(e->addr, *addr);
+  e->port = port;
+  e->mid = mid;
+  e->expires = now + COAP_DEDUP_LIFETIME;
+  return e;
+}
+/*---------------------------------------------------------------------------*/
+/* returns the MID of a CON request datagram or -1 for anything else */
+static int
+request_mid(received_item_t *datagram)
+{
+  struct pbuf *p = datagram->p;
+  uint8_t *header = p->payload;
+
+  /* only the fixed header is looked at, options stay unparsed */
+  if(p->len < COAP_HEADER_LEN
+     || (header[0] & COAP_HEADER_VERSION_MASK) >> COAP_HEADER_VERSION_POSITION != 1
+     || (header[0] & COAP_HEADER_TYPE_MASK) >> COAP_HEADER_TYPE_POSITION != COAP_TYPE_CON
+     || header[1] < COAP_GET || header[1] > COAP_DELETE) {
+    return -1;
+  }
+  return header[2] << 8 | header[3];
+}
+/*---------------------------------------------------------------------------*/
+int
+coap_dedup_answer(received_item_t *datagram)
+{
+  int mid = request_mid(datagram);
+  unsigned int shard;
+  TickType_t now = xTaskGetTickCount();
+  coap_dedup_entry_t *e;
+
+  if(mid < 0) {
+    return 0;
+  }
+
+  shard = coap_endpoint_shard(&datagram->addr, datagram->port);
+  e = lookup(caches[shard], &datagram->addr, datagram->port, mid, now);
+  if(e == NULL) {
+    /* mark it in progress so that a retransmission in the same batch is caught */
+    e = claim(caches[shard], &datagram->addr, datagram->port, mid, now);
+    e->len = 0;
+    e->pending = 1;
+    return 0;
+  }
+  COAP_STATS_INC(shard, duplicate_requests);
+  if(e->pending) {
+    /* the original is still being handled, its response answers this one too */
+    PRINTF("Duplicate CON %u in progress, dropped\n", mid);
+    return 1;
+  }
+  PRINTF("Duplicate CON %u, resending %u bytes\n", mid, e->len);
+  coap_send_message(&datagram->addr, datagram->port, e->response, e->len);
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+void
+coap_dedup_release(received_item_t *datagram)
+{
+  int mid = request_mid(datagram);
+  coap_dedup_entry_t *e;
+
+  if(mid < 0) {
+    return;
+  }
+  e = lookup(caches[coap_endpoint_shard(&datagram->addr, datagram->port)],
+             &datagram->addr, datagram->port, mid, xTaskGetTickCount());
+  if(e && e->pending) {
+    /* no response was stored, duplicates are handled as new requests again */
+    e->pending = 0;
+  }
+}
+/*---------------------------------------------------------------------------*/
+void
+coap_dedup_store(ip_addr_t *addr, uint16_t port, uint16_t mid,
+                 uint8_t *response, size_t len)
+{
+  coap_dedup_entry_t *e;
+
+  if(len == 0 || len > COAP_DEDUP_RESPONSE_SIZE) {
+    /* left to coap_dedup_release(), duplicates are handled as new requests again */
+    return;
+  }
+  e = claim(caches[coap_endpoint_shard(addr, port)], addr, port, mid,
+            xTaskGetTickCount());
+  e->pending = 0;
+  e->len = len;
+  memcpy(e->response, response, len);
+}
+/*---------------------------------------------------------------------------*/
+
+#endif /* COAP_DEDUP_CACHE_SIZE > 0 */
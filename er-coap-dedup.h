@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2017, Department of Computer Engineering, UniPi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ */
+
+/**
+ * \file
+ *      Response cache for duplicate confirmable requests (RFC 7252,
+ *      Section 4.5). Each engine worker keeps the last responses to the
+ *      endpoints of its shard and answers retransmitted CONs from there.
+ */
+
+#ifndef ER_COAP_DEDUP_H_
+#define ER_COAP_DEDUP_H_
+
+#include "porting.h"
+#include "er-coap-conf.h"
+
+/* answers a retransmitted CON request from the cache, returns 1 if the datagram was handled;
+ * a new CON request is marked in progress until its response is stored or it is released */
+int coap_dedup_answer(received_item_t *datagram);
+void coap_dedup_release(received_item_t *datagram);
+void coap_dedup_store(ip_addr_t *addr, uint16_t port, uint16_t mid,
+                      uint8_t *response, size_t len);
+
+#endif /* ER_COAP_DEDUP_H_ */
@@ -73,6 +73,35 @@ static service_callback_t service_cbk = NULL;
 QueueHandle_t *receivequeue_ptr;
 static QueueHandle_t responsequeue;
 
+#if COAP_AUTO_SEPARATE
+/* empty ACK on behalf of a slow handler, shared with the timer task */
+typedef struct coap_deadline {
+	TimerHandle_t timer;
+	ip_addr_t addr;
+	uint16_t port;
+	uint16_t mid;
+	uint8_t armed;
+	uint8_t acked;
+} coap_deadline_t;
+#endif
+
+/* state of one engine task, nothing in here is shared with the other workers */
+typedef struct coap_worker {
+	QueueHandle_t queue;
+	coap_context_t context;
+	received_item_t datagrams[COAP_RECEIVE_BATCH_SIZE];
+	coap_packet_t messages[COAP_RECEIVE_BATCH_SIZE];
+	coap_status_t status[COAP_RECEIVE_BATCH_SIZE];
+	char *error_message[COAP_RECEIVE_BATCH_SIZE];
+	coap_packet_t response[1];
+	uint8_t payload_buffer[REST_MAX_CHUNK_SIZE + 1]; /* handler output for requests with No-Response */
+#if COAP_AUTO_SEPARATE
+	coap_deadline_t deadline;
+#endif
+} coap_worker_t;
+
+static coap_worker_t workers[COAP_ENGINE_WORKERS];
+
 ///* Dimensions the buffer that the task being created will use as its stack.
 //NOTE:  This is the number of words the stack will hold, not the number of
 //bytes.  For example, if each stack item is 32-bits, and this is set to 100,
@@ -97,269 +126,491 @@ bool uip_newdata() {
 	return (uxNumberOfItems != 0);
 }
 
-static int coap_receive(void) {
-	static coap_packet_t message[1]; /* this way the packet can be treated as pointer as usual */
-	static coap_packet_t response[1];
-	static coap_transaction_t *transaction = NULL;
-	erbium_status_code = NO_ERROR;
-	received_item_t datagram;
-
-	if (uip_newdata()) {
-		xQueueReceive(*receivequeue_ptr, &datagram, 1000);
-		struct pbuf *p = datagram.p;
-		struct ip_addr *addr = &datagram.addr;
-		u16_t port = datagram.port;
-
-		PRINTF("receiving UDP datagram from: ");
-		PRINT4ADDR(addr);
-		PRINTF(":%u\n  Length: %u\n", port, p->len);
-
-		erbium_status_code = coap_parse_message(message, p->payload, p->len);
-
-		if (erbium_status_code == NO_ERROR) {
-			message->addr = *addr;
-			message->port = port;
-			/*TODO duplicates suppression, if required by application */
-
-			PRINTF("  Parsed: v %u, t %u, tkl %u, c %u, mid %u\n",
-					message->version, message->type, message->token_len,
-					message->code, message->mid);
-			PRINTF("  URL: %.*s\n", message->uri_path_len, message->uri_path);
-			PRINTF("  Payload: %.*s\n", message->payload_len, message->payload);
-
-			/* handle requests */
-			if (message->code >= COAP_GET && message->code <= COAP_DELETE) {
-
-				/* use transaction buffer for response to confirmable request */
-				if ((transaction = coap_new_transaction(message->mid, addr,
-						port))) {
-					uint32_t block_num = 0;
-					uint16_t block_size = COAP_MAX_BLOCK_SIZE;
-					uint32_t block_offset = 0;
-					int32_t new_offset = 0;
-
-					/* prepare response */
+/*---------------------------------------------------------------------------*/
+static void coap_empty_ack(uint8_t *ack, uint16_t mid) {
+	ack[0] = 1 << COAP_HEADER_VERSION_POSITION
+			| COAP_TYPE_ACK << COAP_HEADER_TYPE_POSITION;
+	ack[1] = 0;
+	ack[2] = (uint8_t) (mid >> 8);
+	ack[3] = (uint8_t) (mid);
+}
+#if COAP_AUTO_SEPARATE
+/*---------------------------------------------------------------------------*/
+/* runs in the timer task while the worker is still inside the handler */
+static void coap_deadline_expired(TimerHandle_t timer) {
+	coap_deadline_t *deadline = (coap_deadline_t *) pvTimerGetTimerID(timer);
+	uint8_t ack[COAP_HEADER_LEN];
+	ip_addr_t addr;
+	uint16_t port;
+	uint16_t mid;
+	int expired;
+
+	/* the handler may accept the request at the same time, only one side ACKs */
+	taskENTER_CRITICAL();
+	expired = deadline->armed;
+	deadline->armed = 0;
+	deadline->acked |= expired;
+	ip_addr_copy(addr, deadline->addr);
+	port = deadline->port;
+	mid = deadline->mid;
+	taskEXIT_CRITICAL();
+
+	if (expired) {
+		PRINTF("Deadline: empty ACK for %u\n", mid);
+		coap_empty_ack(ack, mid);
+		coap_send_message(&addr, port, ack, sizeof(ack));
+	}
+}
+static void coap_deadline_start(coap_deadline_t *deadline,
+		coap_packet_t *request) {
+	taskENTER_CRITICAL();
+	ip_addr_copy(deadline->addr, request->addr);
+	deadline->port = request->port;
+	deadline->mid = request->mid;
+	deadline->acked = 0;
+	deadline->armed = deadline->timer != NULL;
+	taskEXIT_CRITICAL();
+
+	if (deadline->armed
+			&& xTimerChangePeriod(deadline->timer,
+					pdMS_TO_TICKS(COAP_SEPARATE_DEADLINE_MS), 0) != pdPASS) {
+		deadline->armed = 0;
+	}
+}
+/* returns 1 if the empty ACK went out and the response has to be separate */
+static int coap_deadline_stop(coap_deadline_t *deadline) {
+	int acked;
+
+	taskENTER_CRITICAL();
+	deadline->armed = 0;
+	acked = deadline->acked;
+	taskEXIT_CRITICAL();
+
+	if (deadline->timer) {
+		xTimerStop(deadline->timer, 0);
+	}
+	return acked;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Called by coap_separate_accept() before its empty ACK. Returns 0 if the
+ * deadline already acknowledged the request, otherwise disarms it.
+ */
+int coap_deadline_claim(ip_addr_t *addr, uint16_t port, uint16_t mid) {
+	coap_deadline_t *deadline =
+			&workers[coap_endpoint_shard(addr, port)].deadline;
+	int claimed = 1;
+
+	taskENTER_CRITICAL();
+	if (deadline->mid == mid && deadline->port == port
+			&& ip_addr_cmp(&deadline->addr, addr)) {
+		claimed = !deadline->acked;
+		deadline->armed = 0;
+		deadline->acked = 1;
+	}
+	taskEXIT_CRITICAL();
+	return claimed;
+}
+#endif /* COAP_AUTO_SEPARATE */
+/*---------------------------------------------------------------------------*/
+/*
+ * Handles one datagram of a batch that coap_engine() already parsed into
+ * message; status and error_message are the results of that parse.
+ */
+static int coap_receive(coap_worker_t *worker, coap_packet_t *message,
+		received_item_t *datagram, coap_status_t status, char *error_message) {
+	coap_packet_t *response = worker->response;
+	coap_transaction_t *transaction = NULL;
+	int separate = 0;
+	int suppressed = 0;
+	int notification = 0;
+	erbium_status_code = status;
+	coap_error_message = error_message;
+
+	struct pbuf *p = datagram->p;
+	struct ip_addr *addr = &datagram->addr;
+	u16_t port = datagram->port;
+
+	PRINTF("receiving UDP datagram from: ");
+	PRINT4ADDR(addr);
+	PRINTF(":%u\n  Length: %u\n", port, p->tot_len);
+
+	if (erbium_status_code == NO_ERROR) {
+		/* retransmitted CONs that are cached or in progress never get here, see coap_accept_datagram() */
+
+		PRINTF("  Parsed: v %u, t %u, tkl %u, c %u, mid %u\n",
+				message->version, message->type, message->token_len,
+				message->code, message->mid);
+		PRINTF("  URL: %.*s\n", message->uri_path_len, message->uri_path);
+		PRINTF("  Payload: %.*s\n", message->payload_len, message->payload);
+
+		/* handle requests */
+		if (message->code >= COAP_GET && message->code <= COAP_DELETE) {
+
+			/* use transaction buffer for response, requests with No-Response only get one if the response is wanted */
+			if (message->no_response
+					|| (transaction = coap_new_transaction(message->mid, addr,
+							port))) {
+				uint8_t *payload_buffer = transaction ?
+						transaction->packet + COAP_MAX_HEADER_SIZE :
+						worker->payload_buffer;
+				uint32_t block_num = 0;
+				uint16_t block_size = COAP_MAX_BLOCK_SIZE;
+				uint32_t block_offset = 0;
+				int32_t new_offset = 0;
+
+				/* prepare response */
+				if (message->type == COAP_TYPE_CON) {
+					/* reliable CON requests are answered with an ACK */
+					coap_init_message(response, COAP_TYPE_ACK, CONTENT_2_05,
+							message->mid);
+				} else {
+					/* unreliable NON requests are answered with a NON as well */
+					coap_init_message(response, COAP_TYPE_NON, CONTENT_2_05,
+							coap_get_mid_for(addr, port));
+					/* mirror token */
+				}
+				if (message->token_len) {
+					coap_set_token(response, message->token,
+							message->token_len);
+					/* get offset for blockwise transfers */
+				}
+				if (coap_get_header_block2(message, &block_num, NULL,
+						&block_size, &block_offset)) {
+					PRINTF(
+							"Blockwise: block request %u (%u/%u) @ %u bytes\n",
+							block_num, block_size, COAP_MAX_BLOCK_SIZE,
+							block_offset);
+					block_size = MIN(block_size, COAP_MAX_BLOCK_SIZE);
+					new_offset = block_offset;
+				}
+
+				/* invoke resource handler */
+				if (service_cbk) {
+					int found;
+
+#if COAP_AUTO_SEPARATE
 					if (message->type == COAP_TYPE_CON) {
-						/* reliable CON requests are answered with an ACK */
-						coap_init_message(response, COAP_TYPE_ACK, CONTENT_2_05,
-								message->mid);
-					} else {
-						/* unreliable NON requests are answered with a NON as well */
-						coap_init_message(response, COAP_TYPE_NON, CONTENT_2_05,
-								coap_get_mid());
-						/* mirror token */
+						coap_deadline_start(&worker->deadline, message);
 					}
-					if (message->token_len) {
-						coap_set_token(response, message->token,
-								message->token_len);
-						/* get offset for blockwise transfers */
-					}
-					if (coap_get_header_block2(message, &block_num, NULL,
-							&block_size, &block_offset)) {
-						PRINTF(
-								"Blockwise: block request %u (%u/%u) @ %u bytes\n",
-								block_num, block_size, COAP_MAX_BLOCK_SIZE,
-								block_offset);
-						block_size = MIN(block_size, COAP_MAX_BLOCK_SIZE);
-						new_offset = block_offset;
+#endif
+					/* call REST framework and check if found and allowed */
+					found = service_cbk(message, response, payload_buffer,
+							block_size, &new_offset);
+#if COAP_AUTO_SEPARATE
+					if (message->type == COAP_TYPE_CON
+							&& coap_deadline_stop(&worker->deadline)
+							&& erbium_status_code != MANUAL_RESPONSE) {
+						/* the request is acknowledged already, answer with a CON of its own */
+						separate = 1;
+						response->type = COAP_TYPE_CON;
+						response->mid = coap_get_mid_for(addr, port);
+						if (transaction) {
+							coap_set_transaction_mid(transaction, response->mid);
+						}
 					}
+#endif
+					if (found) {
 
-					/* invoke resource handler */
-					if (service_cbk) {
-
-						/* call REST framework and check if found and allowed */
-						if (service_cbk(message, response,
-								transaction->packet + COAP_MAX_HEADER_SIZE,
-								block_size, &new_offset)) {
-
-							if (erbium_status_code == NO_ERROR) {
+						if (erbium_status_code == NO_ERROR) {
 
-								/* TODO coap_handle_blockwise(request, response, start_offset, end_offset); */
+							/* TODO coap_handle_blockwise(request, response, start_offset, end_offset); */
 
-								/* resource is unaware of Block1 */
-								if (IS_OPTION(message,
-										COAP_OPTION_BLOCK1) && response->code < BAD_REQUEST_4_00
-										&& !IS_OPTION(response, COAP_OPTION_BLOCK1)) {
-									PRINTF("Block1 NOT IMPLEMENTED\n");
+							/* resource is unaware of Block1 */
+							if (IS_OPTION(message,
+									COAP_OPTION_BLOCK1) && response->code < BAD_REQUEST_4_00
+									&& !IS_OPTION(response, COAP_OPTION_BLOCK1)) {
+								PRINTF("Block1 NOT IMPLEMENTED\n");
 
-									erbium_status_code = NOT_IMPLEMENTED_5_01;
-									coap_error_message = "NoBlock1Support";
+								erbium_status_code = NOT_IMPLEMENTED_5_01;
+								coap_error_message = "NoBlock1Support";
 
-									/* client requested Block2 transfer */
-								} else if (IS_OPTION(message,
-										COAP_OPTION_BLOCK2)) {
+								/* client requested Block2 transfer */
+							} else if (IS_OPTION(message,
+									COAP_OPTION_BLOCK2)) {
 
-									/* unchanged new_offset indicates that resource is unaware of blockwise transfer */
-									if (new_offset == block_offset) {
+								/* unchanged new_offset indicates that resource is unaware of blockwise transfer */
+								if (new_offset == block_offset) {
+									PRINTF(
+											"Blockwise: unaware resource with payload length %u/%u\n",
+											response->payload_len,
+											block_size);
+									if (block_offset
+											>= response->payload_len) {
 										PRINTF(
-												"Blockwise: unaware resource with payload length %u/%u\n",
-												response->payload_len,
-												block_size);
-										if (block_offset
-												>= response->payload_len) {
-											PRINTF(
-													"handle_incoming_data(): block_offset >= response->payload_len\n");
-
-											response->code = BAD_OPTION_4_02;
-											coap_set_payload(response,
-													"BlockOutOfScope", 15); /* a const char str[] and sizeof(str) produces larger code size */
-										} else {
-											coap_set_header_block2(response,
-													block_num,
-													response->payload_len
-															- block_offset
-															> block_size,
-													block_size);
-											coap_set_payload(response,
-													response->payload
-															+ block_offset,
-													MIN(
-															response->payload_len
-																	- block_offset,
-															block_size));
-										} /* if(valid offset) */
-
-										/* resource provides chunk-wise data */
+												"handle_incoming_data(): block_offset >= response->payload_len\n");
+
+										response->code = BAD_OPTION_4_02;
+										coap_set_payload(response,
+												"BlockOutOfScope", 15); /* a const char str[] and sizeof(str) produces larger code size */
 									} else {
-										PRINTF(
-												"Blockwise: blockwise resource, new offset %d\n",
-												new_offset);
 										coap_set_header_block2(response,
 												block_num,
-												new_offset != -1
-														|| response->payload_len
-																> block_size,
+												response->payload_len
+														- block_offset
+														> block_size,
 												block_size);
-
-										if (response->payload_len
-												> block_size) {
-											coap_set_payload(response,
-													response->payload,
-													block_size);
-										}
-									} /* if(resource aware of blockwise) */
-
-									/* Resource requested Block2 transfer */
-								} else if (new_offset != 0) {
+										coap_set_payload(response,
+												response->payload
+														+ block_offset,
+												MIN(
+														response->payload_len
+																- block_offset,
+														block_size));
+									} /* if(valid offset) */
+
+									/* resource provides chunk-wise data */
+								} else {
 									PRINTF(
-											"Blockwise: no block option for blockwise resource, using block size %u\n",
-											COAP_MAX_BLOCK_SIZE);
-
-									coap_set_header_block2(response, 0,
-											new_offset != -1,
-											COAP_MAX_BLOCK_SIZE);
-									coap_set_payload(response,
-											response->payload,
-											MIN(response->payload_len,
-													COAP_MAX_BLOCK_SIZE));
-								} /* blockwise transfer handling */
-							} /* no errors/hooks */
-							/* successful service callback */
-							/* serialize response */
-						}
-						if (erbium_status_code == NO_ERROR) {
-							if ((transaction->packet_len =
-									coap_serialize_message(response,
-											transaction->packet,
-											&transaction->addr,
-											transaction->port)) == 0) {
-								erbium_status_code = PACKET_SERIALIZATION_ERROR;
-							}
+											"Blockwise: blockwise resource, new offset %d\n",
+											new_offset);
+									coap_set_header_block2(response,
+											block_num,
+											new_offset != -1
+													|| response->payload_len
+															> block_size,
+											block_size);
+
+									if (response->payload_len
+											> block_size) {
+										coap_set_payload(response,
+												response->payload,
+												block_size);
+									}
+								} /* if(resource aware of blockwise) */
+
+								/* Resource requested Block2 transfer */
+							} else if (new_offset != 0) {
+								PRINTF(
+										"Blockwise: no block option for blockwise resource, using block size %u\n",
+										COAP_MAX_BLOCK_SIZE);
+
+								coap_set_header_block2(response, 0,
+										new_offset != -1,
+										COAP_MAX_BLOCK_SIZE);
+								coap_set_payload(response,
+										response->payload,
+										MIN(response->payload_len,
+												COAP_MAX_BLOCK_SIZE));
+							} /* blockwise transfer handling */
+						} /* no errors/hooks */
+						/* successful service callback */
+						/* serialize response */
+					}
+					if (erbium_status_code == NO_ERROR) {
+						if (coap_is_response_suppressed(message,
+								response->code)) {
+							PRINTF("No-Response: suppressing %u\n",
+									response->code);
+							suppressed = 1;
+						} else if (transaction == NULL
+								&& (transaction = coap_new_transaction(
+										separate ? response->mid : message->mid,
+										addr, port)) == NULL) {
+							erbium_status_code = SERVICE_UNAVAILABLE_5_03;
+							coap_error_message = "NoFreeTraBuffer";
+						} else if (coap_serialize_transaction(transaction,
+								response) == 0) {
+							erbium_status_code = PACKET_SERIALIZATION_ERROR;
 						}
-					} else {
-						erbium_status_code = NOT_IMPLEMENTED_5_01;
-						coap_error_message = "NoServiceCallbck"; /* no 'a' to fit into 16 bytes */
-					} /* if(service callback) */
+					}
 				} else {
-					erbium_status_code = SERVICE_UNAVAILABLE_5_03;
-					coap_error_message = "NoFreeTraBuffer";
-				} /* if(transaction buffer) */
-
-				/* handle responses */
+					erbium_status_code = NOT_IMPLEMENTED_5_01;
+					coap_error_message = "NoServiceCallbck"; /* no 'a' to fit into 16 bytes */
+				} /* if(service callback) */
 			} else {
+				erbium_status_code = SERVICE_UNAVAILABLE_5_03;
+				coap_error_message = "NoFreeTraBuffer";
+			} /* if(transaction buffer) */
 
-				if (message->type == COAP_TYPE_CON && message->code == 0) {
-					PRINTF("Received Ping\n");
-					erbium_status_code = PING_RESPONSE;
-				} else if (message->type == COAP_TYPE_ACK) {
-					/* transactions are closed through lookup below */
-					PRINTF("Received ACK\n");
-				} else if (message->type == COAP_TYPE_RST) {
-					PRINTF("Received RST\n");
-					/* cancel possible subscriptions */
-					coap_remove_observer_by_mid(addr, port, message->mid);
-				}
+			/* handle responses */
+		} else {
 
-				if ((transaction = coap_get_transaction_by_mid(message->mid))) {
-					PRINTF("transaction found\n");
-					/* free transaction memory before callback, as it may create a new transaction */
-					restful_response_handler callback = transaction->callback;
-					void *callback_data = transaction->callback_data;
-
-					coap_clear_transaction(transaction);
-					PRINTF("clear_transaction\n");
-					/* check if someone registered for the response */
-					if (callback) {
-						callback(callback_data, message);
+			if (message->type == COAP_TYPE_CON && message->code == 0) {
+				PRINTF("Received Ping\n");
+				erbium_status_code = PING_RESPONSE;
+			} else if (message->type == COAP_TYPE_ACK) {
+				/* transactions are closed through lookup below, notifications by the observe layer */
+				PRINTF("Received ACK\n");
+				notification = coap_observe_acknowledged(addr, port, message->mid);
+			} else if (message->type == COAP_TYPE_RST) {
+				PRINTF("Received RST\n");
+				/* cancel possible subscriptions */
+				notification = coap_remove_observer_by_mid(addr, port,
+						message->mid);
+			}
+
+			if (notification) {
+				PRINTF("notification closed\n");
+			} else if ((transaction = coap_get_transaction(message->mid, addr,
+					port))) {
+				PRINTF("transaction found\n");
+				/* only CONs still waiting for their ACK give an RTT sample */
+				if (coap_timer_armed(&transaction->retrans_timer)) {
+					TickType_t rtt = xTaskGetTickCount() - transaction->sent;
+
+					if (message->type == COAP_TYPE_RST) {
+						COAP_STATS_INC(transaction->shard, reset);
+					} else {
+						COAP_STATS_INC(transaction->shard, acked);
 					}
+					coap_stats_record(
+							coap_stats_shard[transaction->shard].rtt, rtt);
+#if COAP_ADAPTIVE_RTO
+					coap_rto_update(addr, port, rtt,
+							transaction->retrans_counter);
+#endif
+				}
+				/* free transaction memory before callback, as it may create a new transaction */
+				restful_response_handler callback = transaction->callback;
+				void *callback_data = transaction->callback_data;
+
+				coap_clear_transaction(transaction);
+				PRINTF("clear_transaction\n");
+				/* check if someone registered for the response */
+				if (callback) {
+					callback(callback_data, message);
 				}
-				/* if(ACKed transaction) */
-				transaction = NULL;
+			} else if (message->type == COAP_TYPE_ACK
+					|| message->type == COAP_TYPE_RST) {
+				COAP_STATS_INC(coap_endpoint_shard(addr, port), duplicate_acks);
+			}
+			/* if(ACKed transaction) */
+			transaction = NULL;
 
 #if COAP_OBSERVE_CLIENT
-				/* if observe notification */
-				if((message->type == COAP_TYPE_CON || message->type == COAP_TYPE_NON)
-						&& IS_OPTION(message, COAP_OPTION_OBSERVE)) {
-					PRINTF("Observe [%u]\n", message->observe);
-					coap_handle_notification(addr, port,
-							message);
-				}
+			/* if observe notification */
+			if((message->type == COAP_TYPE_CON || message->type == COAP_TYPE_NON)
+					&& IS_OPTION(message, COAP_OPTION_OBSERVE)) {
+				PRINTF("Observe present\n");
+				coap_handle_notification(addr, port,
+						message);
+			}
 #endif /* COAP_OBSERVE_CLIENT */
-			} /* request or response */
-		} /* parsed correctly */
+		} /* request or response */
+	} /* parsed correctly */
+
+	/* error replies to requests are subject to No-Response as well */
+	if (message->no_response && erbium_status_code != NO_ERROR
+			&& erbium_status_code != MANUAL_RESPONSE
+			&& erbium_status_code != PING_RESPONSE) {
+		suppressed = coap_is_response_suppressed(message,
+				erbium_status_code >= 192 ?
+						INTERNAL_SERVER_ERROR_5_00 : erbium_status_code);
+	}
 
-		/* if(parsed correctly) */
-		if (erbium_status_code == NO_ERROR) {
-			if (transaction) {
-				coap_send_transaction(transaction);
-			}
-		} else if (erbium_status_code == MANUAL_RESPONSE) {
-			PRINTF("Clearing transaction for manual response");
-			coap_clear_transaction(transaction);
-		} else {
-			coap_message_type_t reply_type = COAP_TYPE_ACK;
-
-			PRINTF("ERROR %u: %s\n", erbium_status_code, coap_error_message);
-			coap_clear_transaction(transaction);
-
-			if (erbium_status_code == PING_RESPONSE) {
-				erbium_status_code = 0;
-				reply_type = COAP_TYPE_RST;
-			} else if (erbium_status_code >= 192) {
-				/* set to sendable error code */
-				erbium_status_code = INTERNAL_SERVER_ERROR_5_00;
-				/* reuse input buffer for error message */
+	/* if(parsed correctly) */
+	if (suppressed) {
+		coap_clear_transaction(transaction);
+		/* a CON is still acknowledged */
+		if (message->type == COAP_TYPE_CON && !separate) {
+			uint8_t ack[COAP_HEADER_LEN];
+
+			coap_empty_ack(ack, message->mid);
+			coap_send_message(addr, port, ack, sizeof(ack));
+#if COAP_DEDUP_CACHE_SIZE > 0
+			coap_dedup_store(addr, port, message->mid, ack, sizeof(ack));
+#endif
+		}
+	} else if (erbium_status_code == NO_ERROR) {
+		if (transaction) {
+#if COAP_DEDUP_CACHE_SIZE > 0
+			if (separate) {
+				/* retransmissions of the request only get the empty ACK again */
+				uint8_t ack[COAP_HEADER_LEN];
+
+				coap_empty_ack(ack, message->mid);
+				coap_dedup_store(addr, port, message->mid, ack, sizeof(ack));
+			} else if (message->type == COAP_TYPE_CON) {
+				coap_dedup_store(addr, port, message->mid,
+						transaction->packet + transaction->packet_offset,
+						transaction->packet_len);
 			}
-			coap_init_message(message, reply_type, erbium_status_code,
-					message->mid);
-			coap_set_payload(message, coap_error_message,
-					strlen(coap_error_message));
-
-			uint8_t buffer[COAP_MAX_PACKET_SIZE];
-			size_t len = coap_serialize_message(message, buffer, addr, port);
-			coap_send_message(addr, port, buffer, len);
+#endif
+			coap_send_transaction(transaction);
+		}
+	} else if (erbium_status_code == MANUAL_RESPONSE) {
+		PRINTF("Clearing transaction for manual response");
+		coap_clear_transaction(transaction);
+	} else {
+		coap_message_type_t reply_type = COAP_TYPE_ACK;
+#if COAP_DEDUP_CACHE_SIZE > 0
+		/* only well-formed CON requests are answered from the duplicate cache */
+		int cache_reply = status == NO_ERROR && message->type == COAP_TYPE_CON
+				&& message->code >= COAP_GET && message->code <= COAP_DELETE
+				&& !separate;
+#endif
+		uint16_t mid = message->mid;
+		uint8_t token[COAP_TOKEN_LEN];
+		uint8_t token_len = 0;
+
+		PRINTF("ERROR %u: %s\n", erbium_status_code, coap_error_message);
+		coap_clear_transaction(transaction);
+
+		if (erbium_status_code == PING_RESPONSE) {
+			erbium_status_code = 0;
+			reply_type = COAP_TYPE_RST;
+		} else if (erbium_status_code >= 192) {
+			/* set to sendable error code */
+			erbium_status_code = INTERNAL_SERVER_ERROR_5_00;
+			/* reuse input buffer for error message */
+		}
+		if (separate) {
+			/* the request got an empty ACK already, the error goes out on its own */
+			reply_type = COAP_TYPE_NON;
+			mid = coap_get_mid_for(addr, port);
+			token_len = message->token_len;
+			memcpy(token, message->token, token_len);
+		}
+		coap_init_message(message, reply_type, erbium_status_code, mid);
+		if (token_len) {
+			coap_set_token(message, token, token_len);
 		}
-		pbuf_free(p);
+		coap_set_payload(message, coap_error_message,
+				strlen(coap_error_message));
+
+		uint8_t buffer[COAP_MAX_PACKET_SIZE];
+		size_t len = coap_serialize_message(message, buffer, addr, port);
+		coap_send_message(addr, port, buffer, len);
+#if COAP_DEDUP_CACHE_SIZE > 0
+		if (cache_reply) {
+			coap_dedup_store(addr, port, message->mid, buffer, len);
+		}
+#endif
 	}
+#if COAP_DEDUP_CACHE_SIZE > 0
+	/* ends the in-progress mark of a request whose response was not cached */
+	coap_dedup_release(datagram);
+#endif
+	pbuf_free(p);
 
-	/* if(new data) */
 	return erbium_status_code;
 }
 /*---------------------------------------------------------------------------*/
 void coap_init_engine(QueueHandle_t * queue) {
+	int i;
+
 	receivequeue_ptr = queue;
 	responsequeue = xQueueCreate(1, sizeof(uint8_t));
-	xTaskCreate(coap_engine, "coap_engine", 256, NULL, 2, NULL);
+
+	/* the first worker serves the application queue, the others get their own */
+	for (i = 0; i < COAP_ENGINE_WORKERS; ++i) {
+		workers[i].queue = i == 0 ?
+				*queue :
+				xQueueCreate(COAP_WORKER_QUEUE_LENGTH, sizeof(received_item_t));
+		workers[i].context.status_code = NO_ERROR;
+		workers[i].context.error_message = "";
+		coap_receive_queues[i] = workers[i].queue;
+#if COAP_AUTO_SEPARATE
+		workers[i].deadline.timer = xTimerCreate("coap_deadline",
+				pdMS_TO_TICKS(COAP_SEPARATE_DEADLINE_MS), pdFALSE,
+				&workers[i].deadline, coap_deadline_expired);
+#endif
+	}
+	for (i = 0; i < COAP_ENGINE_WORKERS; ++i) {
+		xTaskCreate(coap_engine, "coap_engine", COAP_ENGINE_STACK_SIZE,
+				&workers[i], 2, NULL);
+	}
 }
 /*---------------------------------------------------------------------------*/
 void coap_set_service_callback(service_callback_t callback) {
@@ -376,29 +627,90 @@ rest_resource_flags_t coap_get_rest_method(void *packet) {
 /* the discover resource is automatically included for CoAP */
 
 extern resource_t res_well_known_core;
+#if COAP_STATS_RESOURCE
+extern resource_t res_coap_stats;
+#endif
 #ifdef WITH_DTLS
 extern resource_t res_dtls;
 #endif
 
+/*---------------------------------------------------------------------------*/
+/*
+ * Returns 1 if the queued datagram has to go through the parser. Kicks carry
+ * no pbuf and retransmitted CON requests are answered from the duplicate
+ * cache right away. New CON requests are marked in progress there, so that
+ * a retransmission within the same batch is dropped as well.
+ */
+static int coap_accept_datagram(received_item_t *datagram) {
+	if (datagram->p == NULL) {
+		return 0;
+	}
+#if COAP_DEDUP_CACHE_SIZE > 0
+	if (coap_dedup_answer(datagram)) {
+		pbuf_free(datagram->p);
+		return 0;
+	}
+#endif
+	return 1;
+}
 /*---------------------------------------------------------------------------*/
 void coap_engine(void *pvParameters) {
+	coap_worker_t *worker = pvParameters ? pvParameters : &workers[0];
+
+#if COAP_ENGINE_WORKERS > 1
+	coap_set_context(&worker->context);
+#endif
 
-	PRINTF("Starting %s receiver...\n", coap_rest_implementation.name);
+	if (worker == &workers[0]) {
+		PRINTF("Starting %s receiver...\n", coap_rest_implementation.name);
 
-	rest_activate_resource(&res_well_known_core, ".well-known/core");
+		rest_activate_resource(&res_well_known_core, ".well-known/core");
+#if COAP_STATS_RESOURCE
+		rest_activate_resource(&res_coap_stats, "stats");
+#endif
 
-	coap_register_as_transaction_handler();
-	coap_init_connection(SERVER_LISTEN_PORT);
+		coap_register_as_transaction_handler();
+		coap_init_connection(SERVER_LISTEN_PORT);
+	}
 
 	while (1) {
-		received_item_t datagram;
-		PRINTF("Before Queue peek\n");
-		if (xQueuePeek(*receivequeue_ptr, &datagram, 1000)) {
-			PRINTF("Queue peek\n");
-			coap_receive();
+		unsigned int shard = worker - workers;
+		TickType_t timeout;
+		int received;
+		int count = 0;
+		int i;
+
+		/* retransmissions are due here, the queue wait ends in time for the next ones */
+		timeout = MIN(coap_timer_run(shard), pdMS_TO_TICKS(1000));
+
+		PRINTF("Before Queue receive\n");
+		received = xQueueReceive(worker->queue, &worker->datagrams[0], timeout);
+		coap_timer_wake(shard);
+		if (!received) {
+			continue;
+		}
+		/* drain what else is already queued without blocking */
+		count = coap_accept_datagram(&worker->datagrams[0]);
+		while (count < COAP_RECEIVE_BATCH_SIZE
+				&& xQueueReceive(worker->queue, &worker->datagrams[count], 0)) {
+			count += coap_accept_datagram(&worker->datagrams[count]);
+		}
+		PRINTF("Queue receive %d\n", count);
+
+		for (i = 0; i < count; ++i) {
+			coap_error_message = "";
+			worker->status[i] = coap_parse_pbuf(&worker->messages[i],
+					worker->datagrams[i].p);
+			worker->error_message[i] = coap_error_message;
+			worker->messages[i].addr = worker->datagrams[i].addr;
+			worker->messages[i].port = worker->datagrams[i].port;
+		}
+		for (i = 0; i < count; ++i) {
+			coap_receive(worker, &worker->messages[i],
+					&worker->datagrams[i], worker->status[i],
+					worker->error_message[i]);
 		}
 	}
-
 }
 /*---------------------------------------------------------------------------*/
 /*- Client Part -------------------------------------------------------------*/
@@ -435,7 +747,7 @@ void coap_blocking_request(void *pvParameters) {
 	block_error = 0;
 
 	do {
-		request->mid = coap_get_mid();
+		request->mid = coap_get_mid_for(remote_ipaddr, remote_port);
 		if ((state->transaction = coap_new_transaction(request->mid,
 				remote_ipaddr, remote_port))) {
 			state->transaction->callback = coap_blocking_request_callback;
@@ -491,13 +803,14 @@ void coap_blocking_request(void *pvParameters) {
 /*---------------------------------------------------------------------------*/
 const struct rest_implementation coap_rest_implementation = { "CoAP-18",
 		coap_init_engine, coap_set_service_callback, coap_get_header_uri_path,
-		coap_get_rest_method, coap_set_status_code,
+		coap_match_uri_path, coap_get_rest_method, coap_set_status_code,
 		coap_get_header_content_format, coap_set_header_content_format,
 		coap_get_header_accept, coap_get_header_size2, coap_set_header_size2,
 		coap_get_header_max_age, coap_set_header_max_age, coap_set_header_etag,
 		coap_get_header_if_match, coap_get_header_if_none_match,
 		coap_get_header_uri_host, coap_set_header_location_path,
-		coap_get_payload, coap_set_payload, coap_get_header_uri_query,
+		coap_get_payload, coap_read_payload, coap_set_payload,
+		coap_get_header_uri_query,
 		coap_get_query_variable, coap_get_post_variable, coap_notify_observers,
 		coap_observe_handler,
 
@@ -44,6 +44,7 @@
 #include "er-coap-transactions.h"
 #include "er-coap-observe.h"
 #include "er-coap-separate.h"
+#include "er-coap-dedup.h"
 //#include "er-coap-observe-client.h"
 
 #define SERVER_LISTEN_PORT      COAP_SERVER_PORT
@@ -54,6 +55,11 @@ typedef coap_packet_t rest_response_t;
 void coap_init_engine(QueueHandle_t * queue);
 void coap_engine(void *pvParameters);
 bool uip_newdata();
+#if COAP_AUTO_SEPARATE
+int coap_deadline_claim(ip_addr_t *addr, uint16_t port, uint16_t mid);
+#else
+#define coap_deadline_claim(addr, port, mid) 1
+#endif
 
 /*---------------------------------------------------------------------------*/
 /*- Client Part -------------------------------------------------------------*/
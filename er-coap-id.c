@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2017, Department of Computer Engineering, UniPi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ */
+
+/**
+ * \file
+ *      Message ID and token generation
+ */
+
+#include <stdlib.h>
+#include "er-coap-id.h"
+#include "er-coap.h"
+#include "er-coap-transactions.h"
+
+#define COAP_DEBUG 0
+#if COAP_DEBUG
+#include <stdio.h>
+#define PRINTF(...) printf(__VA_ARGS__)
+#else
+#define PRINTF(...)
+#endif
+
+/*---------------------------------------------------------------------------*/
+/* one MID space per shard, endpoints never move between shards */
+static uint16_t current_mid[COAP_ENGINE_WORKERS];
+static uint32_t token_state = 1;
+
+/*---------------------------------------------------------------------------*/
+void
+coap_init_ids(void)
+{
+  int i;
+
+  for(i = 0; i < COAP_ENGINE_WORKERS; ++i) {
+    current_mid[i] = rand();
+  }
+  /* xorshift must not start from 0 */
+  token_state = ((uint32_t)rand() << 16 ^ rand() ^ xTaskGetTickCount()) | 1;
+}
+/*---------------------------------------------------------------------------*/
+static uint16_t
+next_mid(unsigned int shard)
+{
+  uint16_t mid;
+
+  taskENTER_CRITICAL();
+  mid = ++current_mid[shard];
+  taskEXIT_CRITICAL();
+  return mid;
+}
+/*---------------------------------------------------------------------------*/
+uint16_t
+coap_get_mid_for(ip_addr_t *addr, uint16_t port)
+{
+  unsigned int shard = coap_endpoint_shard(addr, port);
+  uint16_t mid = next_mid(shard);
+  int tries;
+
+  /* the shard has at most COAP_MAX_OPEN_TRANSACTIONS open, so this ends with a free MID */
+  for(tries = 0; tries < COAP_MAX_OPEN_TRANSACTIONS
+      && coap_get_transaction(mid, addr, port); ++tries) {
+    PRINTF("MID %u still in use\n", mid);
+    mid = next_mid(shard);
+  }
+  return mid;
+}
+/*---------------------------------------------------------------------------*/
+void
+coap_generate_token(uint8_t *token, uint8_t len)
+{
+  uint32_t x = 0;
+  uint8_t i;
+
+  for(i = 0; i < len; ++i) {
+    if((i & 3) == 0) {
+      taskENTER_CRITICAL();
+      x = token_state;
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      token_state = x;
+      taskEXIT_CRITICAL();
+    }
+    token[i] = (uint8_t)x;
+    x >>= 8;
+  }
+}
+/*---------------------------------------------------------------------------*/
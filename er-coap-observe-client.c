@@ -296,17 +296,6 @@ handle_obs_registration_response(void *data, void *response)
   }
 }
 /*----------------------------------------------------------------------------*/
-uint8_t
-coap_generate_token(uint8_t **token_ptr)
-{
-  static uint8_t token = 0;
-
-  token++;
-  /* FIXME: we should check that this token is not already used */
-  *token_ptr = (uint8_t *)&token;
-  return sizeof(token);
-}
-/*----------------------------------------------------------------------------*/
 coap_observee_t *
 coap_obs_request_registration(ip_addr_t *addr, uint16_t port, char *uri,
                               notification_callback_t notification_callback,
@@ -314,15 +303,16 @@ coap_obs_request_registration(ip_addr_t *addr, uint16_t port, char *uri,
 {
   coap_packet_t request[1];
   coap_transaction_t *t;
-  uint8_t *token;
-  uint8_t token_len;
+  uint8_t token[COAP_GENERATED_TOKEN_LEN];
+  uint8_t token_len = COAP_GENERATED_TOKEN_LEN;
   coap_observee_t *obs;
 
   obs = NULL;
-  coap_init_message(request, COAP_TYPE_CON, COAP_GET, coap_get_mid());
+  coap_init_message(request, COAP_TYPE_CON, COAP_GET,
+                    coap_get_mid_for(addr, port));
   coap_set_header_uri_path(request, uri);
   coap_set_header_observe(request, 0);
-  token_len = coap_generate_token(&token);
+  coap_generate_token(token, token_len);
   set_token(request, token, token_len);
   t = coap_new_transaction(request->mid, addr, port);
   if(t) {
@@ -37,6 +37,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ip_addr.h>
 #include "er-coap-observe.h"
@@ -68,23 +69,452 @@
 
 /*---------------------------------------------------------------------------*/
 MEMB(observers_memb, coap_observer_t, COAP_MAX_OBSERVERS);
-LIST(observers_list);
+/* observers are chained to their resource; this index finds them by endpoint */
+static coap_observer_t *endpoint_buckets[COAP_OBSERVER_BUCKETS];
 static int initialized = 0;
+/* tasks walking the observers, counted by the parity of the epoch they entered in */
+static uint8_t epoch = 0;
+static uint8_t readers[2];
+static uint8_t tombstones = 0;
+
+static void notify_observers(resource_t *resource, const char *subpath,
+		coap_observer_t *timer);
 /*---------------------------------------------------------------------------*/
 /*- Internal API ------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
+static unsigned int endpoint_bucket(ip_addr_t *addr, uint16_t port) {
+	uint32_t hash = addr->addr ^ ((uint32_t) port << 16);
+
+	hash *= 2654435761u;
+	return (hash >> 16) % COAP_OBSERVER_BUCKETS;
+}
+static int same_endpoint(coap_observer_t *o, ip_addr_t *addr, uint16_t port) {
+	return o->port == port && ip_addr_cmp(&o->addr, addr);
+}
+/*---------------------------------------------------------------------------*/
+/*- Observer store ----------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+/*
+ * Observers are read without locking, e.g., by notifications from application
+ * tasks while an engine worker removes one. Removal unlinks the entry and
+ * retires it as a tombstone under the current epoch. Readers that entered
+ * before may still stand on it and skip it; its next pointers stay intact, so
+ * they can move on. Readers are counted per epoch, and once those of the
+ * previous epoch left, its tombstones are freed and the epoch advances. Steady
+ * traffic from several tasks thus cannot hold tombstones back. Writers link
+ * and unlink in critical sections.
+ */
+static void unlink_observer(coap_observer_t *o) {
+	coap_observer_t **link;
+
+	for (link = (coap_observer_t **) &o->resource->observers; *link != o;
+			link = &(*link)->next)
+		;
+	*link = o->next;
+	for (link = &endpoint_buckets[endpoint_bucket(&o->addr, o->port)];
+			*link != o; link = &(*link)->endpoint_next)
+		;
+	*link = o->endpoint_next;
+}
+/*
+ * Call in a critical section. Pending tombstones were retired in the current
+ * or the previous epoch, as the epoch only advances once the readers of the
+ * previous one left.
+ */
+static void reclaim_observers(void) {
+	coap_observer_t *o;
+	int i;
+
+	while (tombstones && readers[(epoch - 1) & 1] == 0) {
+		o = (coap_observer_t *) observers_memb.mem;
+		for (i = 0; i < COAP_MAX_OBSERVERS && tombstones; ++i, ++o) {
+			if (observers_memb.count[i] && o->removed && o->epoch != epoch) {
+				PRINTF("Freeing observer for /%s\n", o->url);
+				/* timers may have been armed again by a reader that still held the entry */
+				coap_timer_stop(&o->con.timer);
+#if COAP_OBSERVE_CONDITIONS
+				coap_timer_stop(&o->timer);
+#endif
+				memb_free(&observers_memb, o);
+				--tombstones;
+			}
+		}
+		/* the tombstones retired so far cannot be reached by readers entering from now on */
+		++epoch;
+	}
+}
+/* returns the epoch to pass to observers_leave() */
+static uint8_t observers_enter(void) {
+	uint8_t entered;
+
+	taskENTER_CRITICAL();
+	entered = epoch;
+	++readers[entered & 1];
+	taskEXIT_CRITICAL();
+	return entered;
+}
+static void observers_leave(uint8_t entered) {
+	taskENTER_CRITICAL();
+	--readers[entered & 1];
+	reclaim_observers();
+	taskEXIT_CRITICAL();
+}
+/*---------------------------------------------------------------------------*/
+/*- Fan-out -----------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+/*
+ * Sends a notification template to one observer. The head is copied with the
+ * observer's type, MID, token, and Observe value patched in; the rest of the
+ * datagram is referenced from the shared buffer until lwIP frees the pbuf.
+ */
+static int send_notification(coap_observer_t *obs, coap_message_type_t type,
+		uint16_t mid, uint32_t observe, coap_shared_buffer_t *shared,
+		uint16_t head_len, uint16_t observe_offset) {
+	uint8_t *template = shared->data;
+	struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, head_len + obs->token_len,
+			PBUF_RAM);
+	struct pbuf *tail;
+	uint8_t *packet;
+
+	if (p == NULL) {
+		PRINTF("Observe: No pbuf for notification\n");
+		return 0;
+	}
+	if (shared->len > head_len) {
+		if ((tail = coap_shared_buffer_pbuf(shared, head_len,
+				shared->len - head_len)) == NULL) {
+			pbuf_free(p);
+			PRINTF("Observe: No pbuf for notification\n");
+			return 0;
+		}
+		pbuf_cat(p, tail);
+	}
+
+	packet = (uint8_t *) p->payload;
+	packet[0] = (COAP_HEADER_VERSION_MASK & 1 << COAP_HEADER_VERSION_POSITION)
+			| (COAP_HEADER_TYPE_MASK & type << COAP_HEADER_TYPE_POSITION)
+			| (COAP_HEADER_TOKEN_LEN_MASK
+					& obs->token_len << COAP_HEADER_TOKEN_LEN_POSITION);
+	packet[1] = template[1];
+	packet[2] = (uint8_t) (mid >> 8);
+	packet[3] = (uint8_t) (mid);
+	memcpy(packet + COAP_HEADER_LEN, obs->token, obs->token_len);
+	memcpy(packet + COAP_HEADER_LEN + obs->token_len, template + COAP_HEADER_LEN,
+			head_len - COAP_HEADER_LEN);
+	if (observe_offset) {
+		uint8_t *value = packet + obs->token_len + observe_offset;
+
+		value[0] = (uint8_t) (observe >> 16);
+		value[1] = (uint8_t) (observe >> 8);
+		value[2] = (uint8_t) (observe);
+	}
+
+	coap_send_pbuf(&obs->addr, obs->port, p);
+	pbuf_free(p);
+	return 1;
+}
+/* sends the current state of a row; a newer one may be swapped in from another task meanwhile */
+static void row_send(coap_observer_t *obs) {
+	coap_notification_row_t *row = &obs->con;
+	unsigned int shard = coap_endpoint_shard(&obs->addr, obs->port);
+	coap_shared_buffer_t *shared;
+	uint16_t head_len = 0;
+	uint16_t observe_offset = 0;
+	uint16_t mid = 0;
+	uint32_t observe = 0;
+	uint8_t retransmission = 0;
+	TickType_t interval = 0;
+
+	taskENTER_CRITICAL();
+	if ((shared = row->shared)) {
+		coap_ref_shared_buffer(shared);
+		head_len = row->head_len;
+		observe_offset = row->observe_offset;
+		mid = row->mid;
+		row->sent_mid = mid;
+		observe = row->observe;
+		retransmission = row->retrans_counter;
+		if (retransmission == 0) {
+			row->sent = xTaskGetTickCount();
+		} else {
+#if COAP_ADAPTIVE_RTO
+			row->retrans_interval = row->retrans_interval * row->retrans_backoff
+					/ 2;
+#else
+			row->retrans_interval *= 2;
+#endif
+		}
+		interval = row->retrans_interval;
+	}
+	taskEXIT_CRITICAL();
+
+	/* closed by an ACK in the meantime */
+	if (shared == NULL) {
+		return;
+	}
+	if (send_notification(obs, COAP_TYPE_CON, mid, observe, shared, head_len,
+			observe_offset)) {
+		if (retransmission) {
+			COAP_STATS_INC(shard, retransmitted);
+		} else {
+			COAP_STATS_INC(shard, sent);
+		}
+	}
+	coap_release_shared_buffer(shared);
+	coap_timer_set(&row->timer, shard, interval);
+}
+/*
+ * Hands a notification to the row of the observer. A state still in flight
+ * is replaced by the newer one (RFC 7641, 4.5.2): the next retransmission
+ * carries it with the new MID and Observe value, while the retransmission
+ * counter and timeout keep running. Otherwise a confirmable notification
+ * starts the row. Returns 0 if the notification has to go out as NON.
+ */
+static int row_submit(coap_observer_t *obs, int confirmable,
+		coap_shared_buffer_t *shared, uint16_t head_len,
+		uint16_t observe_offset, uint16_t mid, uint32_t observe) {
+	coap_notification_row_t *row = &obs->con;
+	coap_shared_buffer_t *previous;
+
+	taskENTER_CRITICAL();
+	if (obs->removed || (row->shared == NULL && !confirmable)) {
+		taskEXIT_CRITICAL();
+		return obs->removed;
+	}
+	previous = row->shared;
+	coap_ref_shared_buffer(shared);
+	row->shared = shared;
+	row->head_len = head_len;
+	row->observe_offset = observe_offset;
+	row->mid = mid;
+	row->observe = observe;
+	if (previous == NULL) {
+		row->retrans_counter = 0;
+#if COAP_ADAPTIVE_RTO
+		row->retrans_interval = coap_rto_initial(&obs->addr, obs->port,
+				&row->retrans_backoff);
+#else
+		row->retrans_interval = pdMS_TO_TICKS((COAP_RESPONSE_TIMEOUT
+				+ (rand() % COAP_RESPONSE_TIMEOUT_BACKOFF_MASK)) * 1000);
+#endif
+	}
+	taskEXIT_CRITICAL();
+
+	if (previous) {
+		PRINTF("Observe: Notification superseded by %u\n", mid);
+		COAP_STATS_INC(coap_endpoint_shard(&obs->addr, obs->port), superseded);
+		coap_release_shared_buffer(previous);
+	} else {
+		row_send(obs);
+	}
+	return 1;
+}
+static void row_close(coap_notification_row_t *row) {
+	coap_shared_buffer_t *shared;
+
+	taskENTER_CRITICAL();
+	shared = row->shared;
+	row->shared = NULL;
+	coap_timer_stop(&row->timer);
+	taskEXIT_CRITICAL();
+	coap_release_shared_buffer(shared);
+}
+/* retransmission timer of a row, runs in the engine worker of the observer */
+static void row_timer_expired(void *data) {
+	coap_observer_t *obs = (coap_observer_t *) data;
+	ip_addr_t addr;
+	uint16_t port = obs->port;
+	uint8_t entered;
+
+	entered = observers_enter();
+	if (obs->removed || obs->con.shared == NULL) {
+		/* closed after the timer fired */
+	} else if (++(obs->con.retrans_counter) > COAP_MAX_RETRANSMIT) {
+		PRINTF("Observe: Notification %u timed out\n", obs->con.mid);
+		COAP_STATS_INC(coap_endpoint_shard(&obs->addr, obs->port), timed_out);
+		ip_addr_copy(addr, obs->addr);
+		coap_remove_observer_by_client(&addr, port);
+	} else {
+		PRINTF("Observe: Retransmitting %u (%u)\n", obs->con.mid,
+				obs->con.retrans_counter);
+		row_send(obs);
+	}
+	observers_leave(entered);
+}
+#if COAP_OBSERVE_CONDITIONS
+/* the value of a representation is the number it starts with */
+static int parse_value(const uint8_t *text, size_t len, float *value) {
+	char number[16];
+	char *end;
+
+	if (len == 0) {
+		return 0;
+	}
+	if (len > sizeof(number) - 1) {
+		len = sizeof(number) - 1;
+	}
+	memcpy(number, text, len);
+	number[len] = '\0';
+	*value = strtof(number, &end);
+	return end != number;
+}
+static int query_value(coap_packet_t *request, const char *name, float *value) {
+	const char *text = NULL;
+	int len = coap_get_query_variable(request, name, &text);
+
+	return len > 0 && parse_value((const uint8_t *) text, len, value);
+}
+static TickType_t query_period(coap_packet_t *request, const char *name) {
+	float seconds;
+
+	if (query_value(request, name, &seconds) && seconds > 0) {
+		return pdMS_TO_TICKS((uint32_t) (seconds * 1000));
+	}
+	return 0;
+}
+/* fires the trailing notification of a coalesced update, or the one due after pmax */
+static void observer_timer_expired(void *data) {
+	coap_observer_t *obs = (coap_observer_t *) data;
+	uint8_t entered;
+
+	entered = observers_enter();
+	if (!obs->removed) {
+		notify_observers(obs->resource, NULL, obs);
+	}
+	observers_leave(entered);
+}
+/* the trailing notification or the one after pmax is due, also if another observer's timer fired first */
+static int timer_due(coap_observer_t *obs) {
+	TickType_t since;
+	int due;
+
+	taskENTER_CRITICAL();
+	since = xTaskGetTickCount() - obs->last_notify;
+	due = (obs->pending && since >= obs->pmin)
+			|| (obs->pmax && since >= obs->pmax);
+	taskEXIT_CRITICAL();
+	return due;
+}
+/* reads pmin, pmax, gt, lt, and st from the registration request */
+static void set_conditions(coap_observer_t *obs, coap_packet_t *request,
+		coap_packet_t *response) {
+	obs->pmin = query_period(request, "pmin");
+	obs->pmax = query_period(request, "pmax");
+	if (obs->pmax && obs->pmax < obs->pmin) {
+		obs->pmax = obs->pmin;
+	}
+	obs->conditions = 0;
+	if (query_value(request, "gt", &obs->gt)) {
+		obs->conditions |= COAP_OBSERVE_GT;
+	}
+	if (query_value(request, "lt", &obs->lt)) {
+		obs->conditions |= COAP_OBSERVE_LT;
+	}
+	if (query_value(request, "st", &obs->st) && obs->st > 0) {
+		obs->conditions |= COAP_OBSERVE_ST;
+	}
+	/* the registration response is the first value reported */
+	if (!parse_value(response->payload, response->payload_len,
+			&obs->last_value)) {
+		obs->last_value = 0;
+	}
+	obs->last_notify = xTaskGetTickCount();
+	if (obs->pmax) {
+		coap_timer_set(&obs->timer, coap_endpoint_shard(&obs->addr, obs->port),
+				obs->pmax);
+	}
+}
+/* a value condition holds when the value crossed gt or lt, or changed by st */
+static int value_condition(coap_observer_t *obs, float value) {
+	float change = value - obs->last_value;
+
+	if ((obs->conditions & COAP_OBSERVE_GT)
+			&& (obs->last_value > obs->gt) != (value > obs->gt)) {
+		return 1;
+	}
+	if ((obs->conditions & COAP_OBSERVE_LT)
+			&& (obs->last_value < obs->lt) != (value < obs->lt)) {
+		return 1;
+	}
+	if ((obs->conditions & COAP_OBSERVE_ST)
+			&& (change >= obs->st || -change >= obs->st)) {
+		return 1;
+	}
+	return obs->conditions == 0;
+}
+/*
+ * Decides if an update goes out to the observer now. Updates within pmin
+ * are coalesced into one trailing notification carrying the latest state.
+ * Application tasks and the engine worker notify concurrently, so the
+ * condition state is only touched in critical sections. Timers are armed
+ * after leaving them, as arming may wake the worker through its queue.
+ */
+static int notification_due(coap_observer_t *obs, int has_value, float value) {
+	TickType_t since;
+	TickType_t trailing = 0;
+	int due = 1;
+
+	taskENTER_CRITICAL();
+	since = xTaskGetTickCount() - obs->last_notify;
+	if (has_value && !value_condition(obs, value)
+			&& !(obs->pmax && since >= obs->pmax)) {
+		due = 0;
+	} else if (obs->pmin && since < obs->pmin) {
+		if (!obs->pending) {
+			obs->pending = 1;
+			trailing = obs->pmin - since;
+		}
+		due = 0;
+	}
+	taskEXIT_CRITICAL();
+
+	if (trailing) {
+		coap_timer_set(&obs->timer, coap_endpoint_shard(&obs->addr, obs->port),
+				trailing);
+	}
+	return due;
+}
+static void notification_sent(coap_observer_t *obs, int has_value, float value) {
+	TickType_t pmax;
+
+	taskENTER_CRITICAL();
+	obs->last_notify = xTaskGetTickCount();
+	obs->pending = 0;
+	if (has_value) {
+		obs->last_value = value;
+	}
+	pmax = obs->pmax;
+	taskEXIT_CRITICAL();
+
+	if (pmax) {
+		coap_timer_set(&obs->timer, coap_endpoint_shard(&obs->addr, obs->port),
+				pmax);
+	} else {
+		coap_timer_stop(&obs->timer);
+	}
+}
+#endif /* COAP_OBSERVE_CONDITIONS */
 static coap_observer_t *
-add_observer(ip_addr_t *addr, uint16_t port, const uint8_t *token,
-		size_t token_len, const char *uri, int uri_len) {
+add_observer(resource_t *resource, ip_addr_t *addr, uint16_t port,
+		const uint8_t *token, size_t token_len, const char *uri, int uri_len) {
+	unsigned int bucket;
+	coap_observer_t *o;
+
+	taskENTER_CRITICAL();
 	if (!initialized) {
 		memb_init(&observers_memb);
-		list_init(observers_list);
 		initialized = 1;
 	}
+	taskEXIT_CRITICAL();
 	/* Remove existing observe relationship, if any. */
 	coap_remove_observer_by_uri(addr, port, uri);
 
-	coap_observer_t *o = memb_alloc(&observers_memb);
+	taskENTER_CRITICAL();
+	/* a recycled slot still reads as removed; clear it before reclaim_observers() sees the slot in use */
+	if ((o = memb_alloc(&observers_memb))) {
+		o->removed = 0;
+	}
+	taskEXIT_CRITICAL();
 
 	if (o) {
 		int max = sizeof(o->url) - 1;
@@ -99,13 +529,31 @@ add_observer(ip_addr_t *addr, uint16_t port, const uint8_t *token,
 		memcpy(o->token, token, token_len);
 		o->last_mid = 0;
 		o->obs_counter = 1;
+		o->con.shared = NULL;
+		coap_timer_init(&o->con.timer, row_timer_expired, o);
+#if COAP_OBSERVE_CONDITIONS
+		coap_timer_init(&o->timer, observer_timer_expired, o);
+		o->pmin = 0;
+		o->pmax = 0;
+		o->conditions = 0;
+		o->pending = 0;
+#endif
 
 		PRINTF("Adding observer (%u/%u) for /%s [0x%02X%02X] from:",
-				list_length(observers_list) + 1, COAP_MAX_OBSERVERS,
-				o->url, o->token[0], o->token[1]);
+				COAP_MAX_OBSERVERS - memb_numfree(&observers_memb),
+				COAP_MAX_OBSERVERS, o->url, o->token[0], o->token[1]);
 		PRINT4ADDR(&o->addr);
 		PRINTF(":%d\n", o->port);
-		list_add(observers_list, o);
+
+		/* fully set up before readers can reach it */
+		o->resource = resource;
+		bucket = endpoint_bucket(addr, port);
+		taskENTER_CRITICAL();
+		o->next = resource->observers;
+		resource->observers = o;
+		o->endpoint_next = endpoint_buckets[bucket];
+		endpoint_buckets[bucket] = o;
+		taskEXIT_CRITICAL();
 	}
 
 	return o;
@@ -113,26 +561,40 @@ add_observer(ip_addr_t *addr, uint16_t port, const uint8_t *token,
 /*---------------------------------------------------------------------------*/
 /*- Removal -----------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
+/* safe while iterating and from any task, the entry is freed once the readers that may hold it left */
 void coap_remove_observer(coap_observer_t *o) {
-	PRINTF("Removing observer for /%s [0x%02X%02X]\n", o->url, o->token[0],
-			o->token[1]);
-
-	memb_free(&observers_memb, o);
-	list_remove(observers_list, o);
+	taskENTER_CRITICAL();
+	if (!o->removed) {
+		PRINTF("Removing observer for /%s [0x%02X%02X]\n", o->url, o->token[0],
+				o->token[1]);
+		o->removed = 1;
+		o->epoch = epoch;
+		++tombstones;
+		unlink_observer(o);
+		row_close(&o->con);
+#if COAP_OBSERVE_CONDITIONS
+		coap_timer_stop(&o->timer);
+#endif
+		reclaim_observers();
+	}
+	taskEXIT_CRITICAL();
 }
 /*---------------------------------------------------------------------------*/
 int coap_remove_observer_by_client(ip_addr_t *addr, uint16_t port) {
 	int removed = 0;
 	coap_observer_t *obs = NULL;
+	uint8_t entered;
 
-	for (obs = (coap_observer_t *) list_head(observers_list); obs;
-			obs = obs->next) {
-		PRINTF("Remove check client "); PRINT4ADDR(addr); PRINTF(":%u\n", port);
-		if (ip_addr_cmp(&obs->addr, addr) && obs->port == port) {
+	PRINTF("Remove check client "); PRINT4ADDR(addr); PRINTF(":%u\n", port);
+	entered = observers_enter();
+	for (obs = endpoint_buckets[endpoint_bucket(addr, port)]; obs;
+			obs = obs->endpoint_next) {
+		if (!obs->removed && same_endpoint(obs, addr, port)) {
 			coap_remove_observer(obs);
 			removed++;
 		}
 	}
+	observers_leave(entered);
 	return removed;
 }
 /*---------------------------------------------------------------------------*/
@@ -140,66 +602,187 @@ int coap_remove_observer_by_token(ip_addr_t *addr, uint16_t port,
 		uint8_t *token, size_t token_len) {
 	int removed = 0;
 	coap_observer_t *obs = NULL;
+	uint8_t entered;
 
-	for (obs = (coap_observer_t *) list_head(observers_list); obs;
-			obs = obs->next) {
-		PRINTF("Remove check Token 0x%02X%02X\n", token[0], token[1]);
-		if (ip_addr_cmp(&obs->addr, addr) && obs->port == port
+	PRINTF("Remove check Token 0x%02X%02X\n", token[0], token[1]);
+	entered = observers_enter();
+	for (obs = endpoint_buckets[endpoint_bucket(addr, port)]; obs;
+			obs = obs->endpoint_next) {
+		if (!obs->removed && same_endpoint(obs, addr, port)
 				&& obs->token_len == token_len
 				&& memcmp(obs->token, token, token_len) == 0) {
 			coap_remove_observer(obs);
 			removed++;
 		}
 	}
+	observers_leave(entered);
 	return removed;
 }
 /*---------------------------------------------------------------------------*/
+/* addr NULL removes the observers of all endpoints */
 int coap_remove_observer_by_uri(ip_addr_t *addr, uint16_t port, const char *uri) {
 	int removed = 0;
 	coap_observer_t *obs = NULL;
+	unsigned int bucket;
+	uint8_t entered;
 
-	for (obs = (coap_observer_t *) list_head(observers_list); obs;
-			obs = obs->next) {
-		PRINTF("Remove check URL %p\n", uri);
-		if ((addr == NULL
-				|| (ip_addr_cmp(&obs->addr, addr) && obs->port == port))
-				&& (obs->url == uri
-						|| memcmp(obs->url, uri, strlen(obs->url)) == 0)) {
-			coap_remove_observer(obs);
-			removed++;
+	PRINTF("Remove check URL %p\n", uri);
+	entered = observers_enter();
+	for (bucket = 0; bucket < COAP_OBSERVER_BUCKETS; ++bucket) {
+		if (addr && bucket != endpoint_bucket(addr, port)) {
+			continue;
+		}
+		for (obs = endpoint_buckets[bucket]; obs; obs = obs->endpoint_next) {
+			if (!obs->removed
+					&& (addr == NULL || same_endpoint(obs, addr, port))
+					&& (obs->url == uri
+							|| memcmp(obs->url, uri, strlen(obs->url)) == 0)) {
+				coap_remove_observer(obs);
+				removed++;
+			}
 		}
 	}
+	observers_leave(entered);
 	return removed;
 }
 /*---------------------------------------------------------------------------*/
 int coap_remove_observer_by_mid(ip_addr_t *addr, uint16_t port, uint16_t mid) {
 	int removed = 0;
 	coap_observer_t *obs = NULL;
+	uint8_t entered;
+
+	PRINTF("Remove check MID %u\n", mid);
+	entered = observers_enter();
+	for (obs = endpoint_buckets[endpoint_bucket(addr, port)]; obs;
+			obs = obs->endpoint_next) {
+		int match;
 
-	for (obs = (coap_observer_t *) list_head(observers_list); obs;
-			obs = obs->next) {
-		PRINTF("Remove check MID %u\n", mid);
-		if (ip_addr_cmp(&obs->addr, addr) && obs->port == port
-				&& obs->last_mid == mid) {
+		if (!same_endpoint(obs, addr, port)) {
+			continue;
+		}
+		/* the RST may be for the CON in flight, sent before a newer state superseded it */
+		taskENTER_CRITICAL();
+		match = !obs->removed
+				&& (obs->last_mid == mid
+						|| (obs->con.shared
+								&& (obs->con.mid == mid || obs->con.sent_mid == mid)));
+		taskEXIT_CRITICAL();
+		if (match) {
 			coap_remove_observer(obs);
 			removed++;
 		}
 	}
+	observers_leave(entered);
 	return removed;
 }
 /*---------------------------------------------------------------------------*/
+/* closes the CON notification an ACK is for, returns 0 if there is none */
+int coap_observe_acknowledged(ip_addr_t *addr, uint16_t port, uint16_t mid) {
+	coap_observer_t *obs = NULL;
+	coap_shared_buffer_t *shared = NULL;
+	unsigned int shard = coap_endpoint_shard(addr, port);
+#if COAP_ADAPTIVE_RTO
+	uint8_t retransmissions = 0;
+#endif
+	TickType_t rtt = 0;
+	uint8_t entered;
+
+	entered = observers_enter();
+	for (obs = endpoint_buckets[endpoint_bucket(addr, port)]; obs && !shared;
+			obs = obs->endpoint_next) {
+		if (!same_endpoint(obs, addr, port)) {
+			continue;
+		}
+		/* a newer state may be swapped in concurrently, under a new MID */
+		taskENTER_CRITICAL();
+		if (!obs->removed && obs->con.shared && obs->con.mid == mid) {
+			shared = obs->con.shared;
+			obs->con.shared = NULL;
+			coap_timer_stop(&obs->con.timer);
+			rtt = xTaskGetTickCount() - obs->con.sent;
+#if COAP_ADAPTIVE_RTO
+			retransmissions = obs->con.retrans_counter;
+#endif
+		}
+		taskEXIT_CRITICAL();
+	}
+	observers_leave(entered);
+
+	if (shared == NULL) {
+		return 0;
+	}
+	PRINTF("Observe: Notification %u acknowledged\n", mid);
+	coap_release_shared_buffer(shared);
+	COAP_STATS_INC(shard, acked);
+	coap_stats_record(coap_stats_shard[shard].rtt, rtt);
+#if COAP_ADAPTIVE_RTO
+	coap_rto_update(addr, port, rtt, retransmissions);
+#endif
+	return 1;
+}
+/*---------------------------------------------------------------------------*/
 /*- Notification ------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 void coap_notify_observers(resource_t *resource) {
-	coap_notify_observers_sub(resource, NULL);
+	notify_observers(resource, NULL, NULL);
+}
+/*
+ * Serializes the notification once without token and with a fixed-width
+ * Observe placeholder. Returns the template length (0 on error) and points
+ * *observe to the Observe value within the template (NULL if not set).
+ */
+static size_t build_notification_template(coap_packet_t *notification,
+		uint8_t *buffer, uint8_t **observe) {
+	size_t len;
+	size_t observe_len = 0;
+
+	*observe = NULL;
+	notification->token_len = 0;
+	if (notification->code < BAD_REQUEST_4_00) {
+		coap_set_header_observe(notification, COAP_OBSERVE_TEMPLATE_VALUE);
+	}
+
+	len = coap_serialize_message(notification, buffer, &notification->addr,
+			notification->port);
+
+	if (len && IS_OPTION(notification, COAP_OPTION_OBSERVE)) {
+		*observe = coap_find_option(buffer, len, COAP_OPTION_OBSERVE,
+				&observe_len);
+		if (observe_len != 3) {
+			*observe = NULL;
+		}
+	}
+	return len;
 }
+/*---------------------------------------------------------------------------*/
 void coap_notify_observers_sub(resource_t *resource, const char *subpath) {
+	notify_observers(resource, subpath, NULL);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * timer is the observer whose pmin or pmax timer fired. The representation of
+ * its URL is rendered once and goes to all of its observers with a timer due.
+ */
+static void notify_observers(resource_t *resource, const char *subpath,
+		coap_observer_t *timer) {
 	/* build notification */
 	coap_packet_t notification[1]; /* this way the packet can be treated as pointer as usual */
 	coap_packet_t request[1]; /* this way the packet can be treated as pointer as usual */
 	coap_observer_t *obs = NULL;
 	int url_len, obs_url_len;
 	char url[COAP_OBSERVER_URL_LEN];
+	/* representation and common options shared by all observers */
+	coap_shared_buffer_t *shared = NULL;
+	uint8_t *template = NULL;
+	size_t template_len = 0;
+	size_t head_len = COAP_HEADER_LEN;
+	uint8_t *observe = NULL;
+	uint16_t observe_offset = 0;
+#if COAP_OBSERVE_CONDITIONS
+	int has_value = 0;
+	float value = 0;
+#endif
+	uint8_t entered;
 
 	url_len = strlen(resource->url);
 	strncpy(url, resource->url, COAP_OBSERVER_URL_LEN - 1);
@@ -207,6 +790,9 @@ void coap_notify_observers_sub(resource_t *resource, const char *subpath) {
 		strncpy(&url[url_len], subpath, COAP_OBSERVER_URL_LEN - url_len - 1);
 	}
 	/* Ensure url is null terminated because strncpy does not guarantee this */
+	if (timer) {
+		strncpy(url, timer->url, COAP_OBSERVER_URL_LEN - 1);
+	}
 	url[COAP_OBSERVER_URL_LEN - 1] = '\0';
 	/* url now contains the notify URL that needs to match the observer */
 	PRINTF("Observe: Notification from %s\n", url);
@@ -216,73 +802,134 @@ void coap_notify_observers_sub(resource_t *resource, const char *subpath) {
 	coap_init_message(request, COAP_TYPE_CON, COAP_GET, 0);
 	coap_set_header_uri_path(request, url);
 
-	/* iterate over observers */
+	/* only observers of this resource are visited; without a subpath all of them match */
 	url_len = strlen(url);
-	for (obs = (coap_observer_t *) list_head(observers_list); obs;
-			obs = obs->next) {
-		obs_url_len = strlen(obs->url);
+	entered = observers_enter();
+	for (obs = (coap_observer_t *) resource->observers; obs; obs = obs->next) {
+		if (obs->removed) {
+			continue;
+		}
+#if COAP_OBSERVE_CONDITIONS
+		if (timer && (strcmp(obs->url, timer->url) != 0
+				|| (obs != timer && !timer_due(obs)))) {
+			continue;
+		}
+#endif
+		if (subpath == NULL) {
+			obs_url_len = url_len;
+		} else {
+			obs_url_len = strlen(obs->url);
+		}
 
 		/* Do a match based on the parent/sub-resource match so that it is
 		 possible to do parent-node observe */
-		if ((obs_url_len == url_len
-				|| (obs_url_len > url_len
-						&& (resource->flags & HAS_SUB_RESOURCES)
-						&& obs->url[url_len] == '/'))
-				&& strncmp(url, obs->url, url_len) == 0) {
-			coap_transaction_t *transaction = NULL;
-
-			/*TODO implement special transaction for CON, sharing the same buffer to allow for more observers */
-
-			if ((transaction = coap_new_transaction(coap_get_mid(), &obs->addr,
-					obs->port))) {
-				if (obs->obs_counter % COAP_OBSERVE_REFRESH_INTERVAL == 0) {
-					PRINTF("           Force Confirmable for\n");
-					notification->type = COAP_TYPE_CON;
-				}
-
-				PRINTF("           Observer "); PRINT4ADDR(&(obs->addr)); PRINTF(":%u\n", obs->port);
+		if (subpath == NULL
+				|| ((obs_url_len == url_len
+						|| (obs_url_len > url_len
+								&& (resource->flags & HAS_SUB_RESOURCES)
+								&& obs->url[url_len] == '/'))
+						&& strncmp(url, obs->url, url_len) == 0)) {
+			int confirmable = 0;
+			uint16_t mid;
+			uint32_t counter = 0;
 
-				/* update last MID for RST matching */
-				obs->last_mid = transaction->mid;
+			/* the resource handler runs and the representation is serialized only once per notify */
+			if (shared == NULL) {
+				if ((shared = coap_alloc_shared_buffer()) == NULL) {
+					/* only this resource misses the update */
+					PRINTF("Observe: No shared buffer for notification\n");
+					COAP_STATS_INC(coap_endpoint_shard(&obs->addr, obs->port),
+							pool_exhausted);
+					break;
+				}
+				template = shared->data;
+				resource->get_handler(request, notification,
+						template + COAP_MAX_HEADER_SIZE, REST_MAX_CHUNK_SIZE,
+						NULL);
+#if COAP_OBSERVE_CONDITIONS
+				has_value = notification->code < BAD_REQUEST_4_00
+						&& parse_value(notification->payload,
+								notification->payload_len, &value);
+#endif
+				template_len = build_notification_template(notification,
+						template, &observe);
+				if (template_len == 0) {
+					PRINTF("Observe: Notification serialization failed\n");
+					break;
+				}
+				shared->len = template_len;
+				/* the head up to the Observe value is per observer, the rest is shared */
+				if (observe) {
+					observe_offset = observe - template;
+					head_len = observe_offset + 3;
+				}
+			}
 
-				/* prepare response */
-				notification->mid = transaction->mid;
+#if COAP_OBSERVE_CONDITIONS
+			if (timer == NULL && !notification_due(obs, has_value, value)) {
+				continue;
+			}
+#endif
+			if (obs->token_len + head_len > COAP_MAX_PACKET_SIZE) {
+				PRINTF("           Notification too large for observer\n");
+				continue;
+			}
 
-				resource->get_handler(request, notification,
-						transaction->packet + COAP_MAX_HEADER_SIZE,
-						REST_MAX_CHUNK_SIZE, NULL);
+			if (obs->obs_counter % COAP_OBSERVE_REFRESH_INTERVAL == 0) {
+				PRINTF("           Force Confirmable for\n");
+				confirmable = 1;
+			}
 
-				if (notification->code < BAD_REQUEST_4_00) {
-					coap_set_header_observe(notification, (obs->obs_counter)++);
-				}
-				coap_set_token(notification, obs->token, obs->token_len);
+			PRINTF("           Observer "); PRINT4ADDR(&(obs->addr)); PRINTF(":%u\n", obs->port);
 
-				transaction->packet_len = coap_serialize_message(notification,
-						transaction->packet, &transaction->addr, transaction->port);
+			/* update last MID for RST matching */
+			mid = coap_get_mid_for(&obs->addr, obs->port);
+			obs->last_mid = mid;
+			if (observe) {
+				counter = (obs->obs_counter)++;
+			}
 
-				coap_send_transaction(transaction);
+			/* CONs go out from the observer's row, so it has at most one in flight */
+			if (row_submit(obs, confirmable, shared, head_len, observe_offset,
+					mid, counter)) {
+				/* sent or superseding the state in flight */
+			} else if (send_notification(obs, COAP_TYPE_NON, mid, counter, shared,
+					head_len, observe_offset)) {
+				COAP_STATS_INC(coap_endpoint_shard(&obs->addr, obs->port), sent);
 			}
+#if COAP_OBSERVE_CONDITIONS
+			notification_sent(obs, has_value, value);
+#endif
 		}
 	}
+	observers_leave(entered);
+	/* rows of CON notifications hold their own references */
+	coap_release_shared_buffer(shared);
 }
 /*---------------------------------------------------------------------------*/
 void coap_observe_handler(resource_t *resource, void *request, void *response) {
 	coap_packet_t * const coap_req = (coap_packet_t *) request;
 	coap_packet_t * const coap_res = (coap_packet_t *) response;
 	coap_observer_t * obs;
+	uint32_t observe;
+	const char *uri = NULL;
+	int uri_len;
 
 	if (coap_req->code == COAP_GET && coap_res->code < 128) { /* GET request and response without error code */
-		if (IS_OPTION(coap_req, COAP_OPTION_OBSERVE)) {
-			if (coap_req->observe == 0) {
+		if (coap_get_header_observe(coap_req, &observe)) {
+			if (observe == 0) {
 				PRINTF("coap_observe_handler ");
 				PRINT4ADDR(&coap_req->addr);
 				PRINTF(":%d\n", coap_req->port);
-				obs = add_observer(&coap_req->addr, coap_req->port,
-						coap_req->token, coap_req->token_len,
-						coap_req->uri_path, coap_req->uri_path_len);
+				uri_len = coap_get_header_uri_path(coap_req, &uri);
+				obs = add_observer(resource, &coap_req->addr, coap_req->port,
+						coap_req->token, coap_req->token_len, uri, uri_len);
 
 				if (obs) {
 					coap_set_header_observe(coap_res, (obs->obs_counter)++);
+#if COAP_OBSERVE_CONDITIONS
+					set_conditions(obs, coap_req, coap_res);
+#endif
 					/*
 					 * Following payload is for demonstration purposes only.
 					 * A subscription should return the same representation as a normal GET.
@@ -293,14 +940,14 @@ void coap_observe_handler(resource_t *resource, void *request, void *response) {
 					coap_set_payload(coap_res,
 							content,
 							snprintf(content, sizeof(content), "Added %u/%u",
-									list_length(observers_list),
+									COAP_MAX_OBSERVERS - memb_numfree(&observers_memb),
 									COAP_MAX_OBSERVERS));
 #endif
 				} else {
 					coap_res->code = SERVICE_UNAVAILABLE_5_03;
 					coap_set_payload(coap_res, "TooManyObservers", 16);
 				}
-			} else if (coap_req->observe == 1) {
+			} else if (observe == 1) {
 
 				/* remove client if it is currently observe */
 				coap_remove_observer_by_token(&coap_req->addr, coap_req->port,
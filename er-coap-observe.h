@@ -46,6 +46,14 @@
 
 #define COAP_OBSERVER_URL_LEN 20
 
+/* Observe value serialized into notification templates, keeps a 3-byte slot for the per-observer counter */
+#define COAP_OBSERVE_TEMPLATE_VALUE 0xFFFFFF
+
+/* conditional notification attributes of an observer */
+#define COAP_OBSERVE_GT 0x01
+#define COAP_OBSERVE_LT 0x02
+#define COAP_OBSERVE_ST 0x04
+
 typedef struct coap_observable {
   uint32_t observe_clock;
   list_t observers;
@@ -53,8 +61,27 @@ typedef struct coap_observable {
   uint8_t buffer[COAP_MAX_PACKET_SIZE + 1];
 } coap_observable_t;
 
+/* CON notification in flight to one observer, the representation stays in the shared buffer */
+typedef struct coap_notification_row {
+  coap_shared_buffer_t *shared; /* serialized template, NULL if no CON notification is outstanding */
+  uint16_t head_len;            /* template bytes patched per observer */
+  uint16_t observe_offset;      /* of the 3-byte Observe value in the template, 0 if none */
+  uint16_t mid;
+  uint16_t sent_mid;             /* of the last transmission, a superseded state may still be RST */
+  uint32_t observe;
+  uint8_t retrans_counter;
+#if COAP_ADAPTIVE_RTO
+  uint8_t retrans_backoff;
+#endif
+  TickType_t retrans_interval;
+  TickType_t sent;
+  coap_timer_t timer;           /* retransmission deadline */
+} coap_notification_row_t;
+
 typedef struct coap_observer {
-  struct coap_observer *next;   /* for LIST */
+  struct coap_observer *next;   /* next observer of the same resource */
+  struct coap_observer *endpoint_next;  /* next observer in the same endpoint bucket */
+  resource_t *resource;
 
   char url[COAP_OBSERVER_URL_LEN];
   ip_addr_t addr;
@@ -64,8 +91,21 @@ typedef struct coap_observer {
   uint16_t last_mid;
 
   int32_t obs_counter;
-  //TimerHandle_t retrans_timer;
-  uint8_t retrans_counter;
+  coap_notification_row_t con;
+  uint8_t removed;              /* tombstone, unlinked and freed once the readers of its epoch left */
+  uint8_t epoch;                /* epoch the tombstone was retired in */
+#if COAP_OBSERVE_CONDITIONS
+  coap_timer_t timer;           /* trailing notification after pmin, or pmax */
+  TickType_t last_notify;
+  TickType_t pmin;              /* 0 if not set */
+  TickType_t pmax;              /* 0 if not set */
+  float gt;
+  float lt;
+  float st;
+  float last_value;             /* numeric value of the last notification */
+  uint8_t conditions;           /* COAP_OBSERVE_GT, _LT, and _ST attributes set */
+  uint8_t pending;              /* an update was coalesced within pmin */
+#endif
 } coap_observer_t;
 
 list_t coap_get_observers(void);
@@ -79,6 +119,8 @@ int coap_remove_observer_by_uri(ip_addr_t *addr, uint16_t port,
 int coap_remove_observer_by_mid(ip_addr_t *addr, uint16_t port,
                                 uint16_t mid);
 
+int coap_observe_acknowledged(ip_addr_t *addr, uint16_t port, uint16_t mid);
+
 void coap_notify_observers(resource_t *resource);
 void coap_notify_observers_sub(resource_t *resource, const char *subpath);
 
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2017, Department of Computer Engineering, UniPi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ */
+
+/**
+ * \file
+ *      Resource exposing the transaction layer statistics, see
+ *      er-coap-stats.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "er-coap-engine.h"
+#include "er-coap-stats.h"
+
+#if COAP_STATS_RESOURCE
+
+/* the text is generated for every block and only the requested window is kept */
+typedef struct stats_window {
+  uint8_t *buffer;
+  int32_t start;
+  uint16_t size;
+  int32_t pos;
+  uint16_t len;
+} stats_window_t;
+
+/*---------------------------------------------------------------------------*/
+static void
+append(stats_window_t *w, const char *text, int len)
+{
+  int32_t from = MAX(w->pos, w->start);
+  int32_t to = MIN(w->pos + len, w->start + w->size);
+
+  if(from < to) {
+    memcpy(w->buffer + (from - w->start), text + (from - w->pos), to - from);
+    w->len = to - w->start;
+  }
+  w->pos += len;
+}
+/*---------------------------------------------------------------------------*/
+static void
+append_counter(stats_window_t *w, const char *name, uint32_t value)
+{
+  char line[32];
+
+  append(w, line, snprintf(line, sizeof(line), "%s=%lu\n", name,
+                           (unsigned long)value));
+}
+/*---------------------------------------------------------------------------*/
+static void
+append_histogram(stats_window_t *w, const char *name, uint32_t *histogram)
+{
+  char value[12];
+  int i;
+
+  append(w, name, strlen(name));
+  for(i = 0; i < COAP_STATS_BUCKETS; ++i) {
+    append(w, value, snprintf(value, sizeof(value), i ? ",%lu" : "=%lu",
+                              (unsigned long)histogram[i]));
+  }
+  append(w, "\n", 1);
+}
+/*---------------------------------------------------------------------------*/
+static void
+stats_get_handler(void *request, void *response, uint8_t *buffer,
+                  uint16_t preferred_size, int32_t *offset)
+{
+  stats_window_t w = { buffer, *offset, preferred_size, 0, 0 };
+  coap_stats_t stats;
+
+  (void)request;
+  coap_get_stats(&stats);
+  append_counter(&w, "sent", stats.sent);
+  append_counter(&w, "retransmitted", stats.retransmitted);
+  append_counter(&w, "timed_out", stats.timed_out);
+  append_counter(&w, "acked", stats.acked);
+  append_counter(&w, "reset", stats.reset);
+  append_counter(&w, "duplicate_acks", stats.duplicate_acks);
+  append_counter(&w, "duplicate_requests", stats.duplicate_requests);
+  append_counter(&w, "queued", stats.queued);
+  append_counter(&w, "pool_exhausted", stats.pool_exhausted);
+  append_counter(&w, "superseded", stats.superseded);
+  append_histogram(&w, "rtt_ms_log2", stats.rtt);
+  append_histogram(&w, "pool_ms_log2", stats.time_in_pool);
+
+  /* counters move between blocks, every block is a fresh snapshot */
+  if(w.len == 0) {
+    coap_set_status_code(response, BAD_OPTION_4_02);
+    coap_set_payload(response, "BlockOutOfScope", 15);
+    return;
+  }
+  coap_set_payload(response, buffer, w.len);
+  coap_set_header_content_format(response, TEXT_PLAIN);
+
+  *offset += preferred_size;
+  if(*offset >= w.pos) {
+    *offset = -1;
+  }
+}
+/*---------------------------------------------------------------------------*/
+RESOURCE(res_coap_stats, "title=\"CoAP statistics\";ct=0", stats_get_handler,
+         NULL, NULL, NULL);
+/*---------------------------------------------------------------------------*/
+
+#endif /* COAP_STATS_RESOURCE */
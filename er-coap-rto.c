@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2017, Department of Computer Engineering, UniPi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ */
+
+/**
+ * \file
+ *      Per-peer retransmission timeouts (CoCoA)
+ */
+
+#include <stdlib.h>
+#include "er-coap-rto.h"
+#include "er-coap.h"
+
+#define COAP_DEBUG 0
+#if COAP_DEBUG
+#include <stdio.h>
+#define PRINTF(...) printf(__VA_ARGS__)
+#else
+#define PRINTF(...)
+#endif
+
+#if COAP_ADAPTIVE_RTO
+
+#define RTO_DEFAULT  pdMS_TO_TICKS(COAP_RESPONSE_TIMEOUT * 1000UL)
+#define RTO_MIN      (pdMS_TO_TICKS(COAP_TIMER_GRANULARITY_MS) > 0 ? pdMS_TO_TICKS(COAP_TIMER_GRANULARITY_MS) : 1)
+#define RTO_MAX      pdMS_TO_TICKS(60000UL)
+#define RTO_1S       pdMS_TO_TICKS(1000UL)
+#define RTO_3S       pdMS_TO_TICKS(3000UL)
+
+#define ESTIMATOR_STRONG  0
+#define ESTIMATOR_WEAK    1
+
+/*---------------------------------------------------------------------------*/
+typedef struct coap_rto_peer {
+  ip_addr_t addr;
+  uint16_t port;
+  uint8_t used;
+  uint8_t measured;             /* bit per estimator that has seen a first sample */
+  TickType_t updated;           /* last change of rto, for aging */
+  TickType_t rto;               /* overall RTO */
+  TickType_t srtt[2];
+  TickType_t rttvar[2];
+} coap_rto_peer_t;
+
+/* per shard, new transactions may also be created from application tasks */
+static coap_rto_peer_t peers[COAP_ENGINE_WORKERS][COAP_RTO_PEERS];
+
+/*---------------------------------------------------------------------------*/
+/* call in a critical section */
+static coap_rto_peer_t *
+find_peer(ip_addr_t *addr, uint16_t port)
+{
+  coap_rto_peer_t *table = peers[coap_endpoint_shard(addr, port)];
+  int i;
+
+  for(i = 0; i < COAP_RTO_PEERS; ++i) {
+    if(table[i].used && table[i].port == port
+       && ip_addr_cmp(&table[i].addr, addr)) {
+      return &table[i];
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* call in a critical section, replaces the peer that has not been updated the longest */
+static coap_rto_peer_t *
+add_peer(ip_addr_t *addr, uint16_t port, TickType_t now)
+{
+  coap_rto_peer_t *table = peers[coap_endpoint_shard(addr, port)];
+  coap_rto_peer_t *p = &table[0];
+  int i;
+
+  for(i = 0; i < COAP_RTO_PEERS && p->used; ++i) {
+    if(!table[i].used || now - table[i].updated > now - p->updated) {
+      p = &table[i];
+    }
+  }
+  ip_addr_copy(p->addr, *addr);
+  p->port = port;
+  p->used = 1;
+  p->measured = 0;
+  p->updated = now;
+  p->rto = RTO_DEFAULT;
+  return p;
+}
+/*---------------------------------------------------------------------------*/
+/* call in a critical section; short RTOs grow and long ones decay towards the default without samples */
+static void
+age_peer(coap_rto_peer_t *p, TickType_t now)
+{
+  TickType_t age = now - p->updated;
+
+  if(p->rto < RTO_1S && age > 16 * p->rto) {
+    p->rto *= 2;
+    p->updated = now;
+  } else if(p->rto > RTO_3S && age > 4 * p->rto) {
+    p->rto = RTO_1S + p->rto / 2;
+    p->updated = now;
+  }
+}
+/*---------------------------------------------------------------------------*/
+TickType_t
+coap_rto_initial(ip_addr_t *addr, uint16_t port, uint8_t *backoff)
+{
+  coap_rto_peer_t *p;
+  TickType_t rto = RTO_DEFAULT;
+
+  taskENTER_CRITICAL();
+  if((p = find_peer(addr, port))) {
+    age_peer(p, xTaskGetTickCount());
+    rto = p->rto;
+  }
+  taskEXIT_CRITICAL();
+
+  /* variable backoff factor */
+  if(rto < RTO_1S) {
+    *backoff = 6;
+  } else if(rto > RTO_3S) {
+    *backoff = 3;
+  } else {
+    *backoff = 4;
+  }
+  /* dithered between RTO and 1.5 * RTO */
+  return rto + rand() % (rto / 2 + 1);
+}
+/*---------------------------------------------------------------------------*/
+void
+coap_rto_update(ip_addr_t *addr, uint16_t port, TickType_t rtt,
+                uint8_t retransmissions)
+{
+  int e = retransmissions ? ESTIMATOR_WEAK : ESTIMATOR_STRONG;
+  TickType_t now = xTaskGetTickCount();
+  TickType_t estimate;
+  TickType_t delta;
+  coap_rto_peer_t *p;
+
+  if(retransmissions > 2) {
+    /* too ambiguous which transmission was acknowledged */
+    return;
+  }
+
+  taskENTER_CRITICAL();
+  if((p = find_peer(addr, port)) == NULL) {
+    p = add_peer(addr, port, now);
+  }
+  if(p->measured & (1 << e)) {
+    delta = p->srtt[e] > rtt ? p->srtt[e] - rtt : rtt - p->srtt[e];
+    p->rttvar[e] = (3 * p->rttvar[e] + delta) / 4;
+    p->srtt[e] = (7 * p->srtt[e] + rtt) / 8;
+  } else {
+    p->srtt[e] = rtt;
+    p->rttvar[e] = rtt / 2;
+    p->measured |= 1 << e;
+  }
+
+  if(e == ESTIMATOR_STRONG) {
+    estimate = p->srtt[e] + 4 * p->rttvar[e];
+    p->rto = (p->rto + estimate) / 2;
+  } else {
+    estimate = p->srtt[e] + p->rttvar[e];
+    p->rto = (3 * p->rto + estimate) / 4;
+  }
+  p->rto = MIN(MAX(p->rto, RTO_MIN), RTO_MAX);
+  p->updated = now;
+  taskEXIT_CRITICAL();
+
+  PRINTF("RTT %lu (%u retransmissions), RTO now %lu\n", (unsigned long)rtt,
+         retransmissions, (unsigned long)p->rto);
+}
+/*---------------------------------------------------------------------------*/
+
+#endif /* COAP_ADAPTIVE_RTO */
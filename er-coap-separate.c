@@ -40,6 +40,8 @@
 #include <string.h>
 #include "er-coap-separate.h"
 #include "er-coap-transactions.h"
+#include "er-coap-dedup.h"
+#include "er-coap-engine.h"
 
 #define COAP_DEBUG 0
 #if COAP_DEBUG
@@ -98,7 +100,9 @@ void
 coap_separate_accept(void *request, coap_separate_t *separate_store)
 {
   coap_packet_t *const coap_req = (coap_packet_t *)request;
-  coap_transaction_t *const t = coap_get_transaction_by_mid(coap_req->mid);
+  coap_transaction_t *const t = coap_get_transaction(coap_req->mid,
+                                                    &coap_req->addr,
+                                                    coap_req->port);
 
   PRINTF("Separate ACCEPT: /%.*s MID %u\n", coap_req->uri_path_len,
          coap_req->uri_path, coap_req->mid);
@@ -112,8 +116,16 @@ coap_separate_accept(void *request, coap_separate_t *separate_store)
       /* serializing into IPBUF: Only overwrites header parts that are already parsed into the request struct */
       uint8_t buffer[COAP_MAX_PACKET_SIZE];
       int len = coap_serialize_message(ack,buffer, &coap_req->addr, coap_req->port);
-      coap_send_message(&coap_req->addr, coap_req->port,
-                        buffer, len);
+      /* the engine's deadline may have sent the empty ACK already */
+      if(coap_deadline_claim(&coap_req->addr, coap_req->port, coap_req->mid)) {
+        coap_send_message(&coap_req->addr, coap_req->port,
+                          buffer, len);
+      }
+#if COAP_DEDUP_CACHE_SIZE > 0
+      /* retransmissions of the request only get the empty ACK again */
+      coap_dedup_store(&coap_req->addr, coap_req->port, coap_req->mid,
+                       buffer, len);
+#endif
     }
 
     /* store remote address */
@@ -124,16 +136,21 @@ coap_separate_accept(void *request, coap_separate_t *separate_store)
     /* store correct response type */
     separate_store->type =
       coap_req->type == COAP_TYPE_CON ? COAP_TYPE_CON : COAP_TYPE_NON;
-    separate_store->mid = coap_get_mid(); /* if it was a NON, we burned one MID in the engine... */
+    separate_store->mid = coap_get_mid_for(&coap_req->addr, coap_req->port); /* if it was a NON, we burned one MID in the engine... */
 
     memcpy(separate_store->token, coap_req->token, coap_req->token_len);
     separate_store->token_len = coap_req->token_len;
 
-    separate_store->block1_num = coap_req->block1_num;
-    separate_store->block1_size = coap_req->block1_size;
+    separate_store->block1_num = 0;
+    separate_store->block1_size = 0;
+    coap_get_header_block1(coap_req, &separate_store->block1_num, NULL,
+                           &separate_store->block1_size, NULL);
 
-    separate_store->block2_num = coap_req->block2_num;
-    separate_store->block2_size = coap_req->block2_size > 0 ? MIN(COAP_MAX_BLOCK_SIZE, coap_req->block2_size) : COAP_MAX_BLOCK_SIZE;
+    separate_store->block2_num = 0;
+    separate_store->block2_size = 0;
+    coap_get_header_block2(coap_req, &separate_store->block2_num, NULL,
+                           &separate_store->block2_size, NULL);
+    separate_store->block2_size = separate_store->block2_size > 0 ? MIN(COAP_MAX_BLOCK_SIZE, separate_store->block2_size) : COAP_MAX_BLOCK_SIZE;
 
     /* signal the engine to skip automatic response and clear transaction by engine */
     erbium_status_code = MANUAL_RESPONSE;
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2017, Department of Computer Engineering, UniPi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ */
+
+/**
+ * \file
+ *      Counters and latency histograms of the CoAP transaction layer
+ */
+
+#include <string.h>
+#include "er-coap-stats.h"
+
+coap_stats_t coap_stats_shard[COAP_ENGINE_WORKERS];
+
+/*---------------------------------------------------------------------------*/
+void
+coap_stats_record(uint32_t *histogram, TickType_t ticks)
+{
+  uint32_t ms = (uint32_t)ticks * portTICK_PERIOD_MS;
+  int bucket = 0;
+
+  while(ms && bucket < COAP_STATS_BUCKETS - 1) {
+    ms >>= 1;
+    ++bucket;
+  }
+  ++histogram[bucket];
+}
+/*---------------------------------------------------------------------------*/
+void
+coap_get_stats(coap_stats_t *stats)
+{
+  uint32_t *sum = (uint32_t *)stats;
+  unsigned int shard;
+  unsigned int i;
+
+  /* the struct is nothing but counters */
+  memset(stats, 0, sizeof(coap_stats_t));
+  for(shard = 0; shard < COAP_ENGINE_WORKERS; ++shard) {
+    uint32_t *counters = (uint32_t *)&coap_stats_shard[shard];
+
+    for(i = 0; i < sizeof(coap_stats_t) / sizeof(uint32_t); ++i) {
+      sum[i] += counters[i];
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+void
+coap_reset_stats(void)
+{
+  memset(coap_stats_shard, 0, sizeof(coap_stats_shard));
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2017, Department of Computer Engineering, UniPi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ */
+
+/**
+ * \file
+ *      Counters and latency histograms of the CoAP transaction layer.
+ */
+
+#ifndef ER_COAP_STATS_H_
+#define ER_COAP_STATS_H_
+
+#include "porting.h"
+#include "er-coap-conf.h"
+
+typedef struct coap_stats {
+  uint32_t sent;                /* transactions sent for the first time */
+  uint32_t retransmitted;
+  uint32_t timed_out;
+  uint32_t acked;               /* CONs closed by an ACK or a response */
+  uint32_t reset;               /* CONs closed by an RST */
+  uint32_t duplicate_acks;      /* ACKs and RSTs without an open transaction */
+  uint32_t duplicate_requests;  /* CONs answered from the duplicate cache */
+  uint32_t queued;              /* CONs held back by NSTART */
+  uint32_t pool_exhausted;      /* coap_new_transaction() without a free slot or buffer */
+  uint32_t superseded;          /* CON notifications replaced by a newer state while in flight */
+  /* bucket 0 counts values below 1 ms, bucket i those in [2^(i-1), 2^i) ms, the last one is open */
+  uint32_t rtt[COAP_STATS_BUCKETS];
+  uint32_t time_in_pool[COAP_STATS_BUCKETS];
+} coap_stats_t;
+
+/* one set per engine worker, merged by coap_get_stats(); updates are not locked */
+extern coap_stats_t coap_stats_shard[COAP_ENGINE_WORKERS];
+
+#define COAP_STATS_INC(shard, counter) (++coap_stats_shard[shard].counter)
+
+void coap_stats_record(uint32_t *histogram, TickType_t ticks);
+void coap_get_stats(coap_stats_t *stats);
+void coap_reset_stats(void);
+
+#endif /* ER_COAP_STATS_H_ */
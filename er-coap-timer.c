@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2017, Department of Computer Engineering, UniPi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ */
+
+/**
+ * \file
+ *      Hashed timing wheel for the CoAP engine workers
+ */
+
+#include "er-coap-timer.h"
+#include "er-coap.h"
+
+#define COAP_DEBUG 0
+#if COAP_DEBUG
+#include <stdio.h>
+#define PRINTF(...) printf(__VA_ARGS__)
+#else
+#define PRINTF(...)
+#endif
+
+#define COAP_TIMER_TICKS  (pdMS_TO_TICKS(COAP_TIMER_GRANULARITY_MS) > 0 ? pdMS_TO_TICKS(COAP_TIMER_GRANULARITY_MS) : 1)
+#define COAP_TIMER_SLOT(ticks)  (((ticks) / COAP_TIMER_TICKS) % COAP_TIMER_WHEEL_SLOTS)
+
+/*---------------------------------------------------------------------------*/
+/* one wheel per engine worker */
+typedef struct coap_timer_wheel {
+  coap_timer_t *slots[COAP_TIMER_WHEEL_SLOTS];
+  TickType_t last_run;
+  TickType_t wakeup;   /* tick the worker sleeps until */
+  uint8_t sleeping;
+  uint16_t count;
+} coap_timer_wheel_t;
+
+static coap_timer_wheel_t wheels[COAP_ENGINE_WORKERS];
+
+/*---------------------------------------------------------------------------*/
+/* call in a critical section */
+static void
+unlink_timer(coap_timer_t *timer)
+{
+  coap_timer_wheel_t *wheel = &wheels[timer->shard];
+
+  if(timer->prev) {
+    timer->prev->next = timer->next;
+  } else {
+    wheel->slots[COAP_TIMER_SLOT(timer->expires)] = timer->next;
+  }
+  if(timer->next) {
+    timer->next->prev = timer->prev;
+  }
+  timer->armed = 0;
+  --wheel->count;
+}
+/*---------------------------------------------------------------------------*/
+void
+coap_timer_init(coap_timer_t *timer, coap_timer_callback_t callback,
+                void *data)
+{
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->callback = callback;
+  timer->data = data;
+  timer->shard = 0;
+  timer->armed = 0;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * \brief Arm a timer on the wheel of an engine worker
+ * \param timer The timer, re-armed if it is already pending
+ * \param shard The worker that fires the callback
+ * \param delay Ticks from now
+ *
+ * When armed from another task while the worker sleeps past the new
+ * deadline, the worker is woken up to adjust its timeout.
+ */
+void
+coap_timer_set(coap_timer_t *timer, unsigned int shard, TickType_t delay)
+{
+  coap_timer_wheel_t *wheel = &wheels[shard];
+  coap_timer_t **slot;
+  int kick = 0;
+
+  taskENTER_CRITICAL();
+  if(timer->armed) {
+    unlink_timer(timer);
+  }
+  timer->shard = shard;
+  timer->expires = xTaskGetTickCount() + delay;
+  slot = &wheel->slots[COAP_TIMER_SLOT(timer->expires)];
+  timer->prev = NULL;
+  timer->next = *slot;
+  if(*slot) {
+    (*slot)->prev = timer;
+  }
+  *slot = timer;
+  timer->armed = 1;
+  ++wheel->count;
+
+  /* the worker sleeps until wakeup, or indefinitely if the wheel was empty */
+  if(wheel->sleeping
+     && (wheel->count == 1 || COAP_TIMER_BEFORE(timer->expires, wheel->wakeup))) {
+    wheel->sleeping = 0;
+    kick = 1;
+  }
+  taskEXIT_CRITICAL();
+
+  if(kick) {
+    coap_kick_worker(shard);
+  }
+}
+/*---------------------------------------------------------------------------*/
+void
+coap_timer_stop(coap_timer_t *timer)
+{
+  taskENTER_CRITICAL();
+  if(timer->armed) {
+    unlink_timer(timer);
+  }
+  taskEXIT_CRITICAL();
+}
+/*---------------------------------------------------------------------------*/
+int
+coap_timer_armed(coap_timer_t *timer)
+{
+  return timer->armed;
+}
+/*---------------------------------------------------------------------------*/
+/* unlinks and returns one expired timer from the slots passed since the last run */
+static coap_timer_t *
+next_expired(coap_timer_wheel_t *wheel, TickType_t now)
+{
+  /* count from the start of the last slot, so a deadline on a boundary is visited when it is due */
+  TickType_t elapsed = now - (wheel->last_run - wheel->last_run % COAP_TIMER_TICKS);
+  unsigned int visits = elapsed / COAP_TIMER_TICKS + 1;
+  unsigned int slot = COAP_TIMER_SLOT(wheel->last_run);
+  coap_timer_t *timer;
+
+  if(visits > COAP_TIMER_WHEEL_SLOTS) {
+    visits = COAP_TIMER_WHEEL_SLOTS;
+  }
+  for(; visits > 0; --visits, slot = (slot + 1) % COAP_TIMER_WHEEL_SLOTS) {
+    for(timer = wheel->slots[slot]; timer; timer = timer->next) {
+      if(!COAP_TIMER_BEFORE(now, timer->expires)) {
+        unlink_timer(timer);
+        return timer;
+      }
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/**
+ * \brief Fire the expired timers of an engine worker
+ * \param shard The calling worker
+ * \return Ticks until the worker has to call again, portMAX_DELAY if idle
+ *
+ * Callbacks run one at a time outside the critical section, so they may arm
+ * or stop any timer. The worker is considered asleep until coap_timer_wake().
+ */
+TickType_t
+coap_timer_run(unsigned int shard)
+{
+  coap_timer_wheel_t *wheel = &wheels[shard];
+  TickType_t now = xTaskGetTickCount();
+  TickType_t delay = portMAX_DELAY;
+  coap_timer_t *timer;
+
+  for(;;) {
+    taskENTER_CRITICAL();
+    timer = next_expired(wheel, now);
+    taskEXIT_CRITICAL();
+    if(timer == NULL) {
+      break;
+    }
+    PRINTF("Timer %p fired\n", timer);
+    timer->callback(timer->data);
+  }
+
+  taskENTER_CRITICAL();
+  wheel->last_run = now;
+  if(wheel->count) {
+    /* expired timers are found when their slot is visited at the next boundary */
+    delay = COAP_TIMER_TICKS - (now % COAP_TIMER_TICKS);
+  }
+  wheel->wakeup = now + delay;
+  wheel->sleeping = 1;
+  taskEXIT_CRITICAL();
+
+  return delay;
+}
+/*---------------------------------------------------------------------------*/
+void
+coap_timer_wake(unsigned int shard)
+{
+  wheels[shard].sleeping = 0;
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2017, Department of Computer Engineering, UniPi
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the Institute nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE INSTITUTE AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE INSTITUTE OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ *
+ */
+
+/**
+ * \file
+ *      Hashed timing wheel for the CoAP engine workers. Timers are armed and
+ *      cancelled in O(1) and fired from the engine loop instead of the
+ *      FreeRTOS timer task.
+ */
+
+#ifndef ER_COAP_TIMER_H_
+#define ER_COAP_TIMER_H_
+
+#include "porting.h"
+#include "er-coap-conf.h"
+
+typedef void (*coap_timer_callback_t)(void *data);
+
+typedef struct coap_timer {
+  struct coap_timer *next;
+  struct coap_timer *prev;
+  TickType_t expires;
+  coap_timer_callback_t callback;
+  void *data;
+  uint8_t shard;
+  uint8_t armed;
+} coap_timer_t;
+
+/* wrap-around safe tick comparison */
+#define COAP_TIMER_BEFORE(a, b) ((int32_t)((TickType_t)(a) - (TickType_t)(b)) < 0)
+
+void coap_timer_init(coap_timer_t *timer, coap_timer_callback_t callback,
+                     void *data);
+void coap_timer_set(coap_timer_t *timer, unsigned int shard, TickType_t delay);
+void coap_timer_stop(coap_timer_t *timer);
+int coap_timer_armed(coap_timer_t *timer);
+
+TickType_t coap_timer_run(unsigned int shard);
+void coap_timer_wake(unsigned int shard);
+
+#endif /* ER_COAP_TIMER_H_ */
@@ -36,6 +36,7 @@
  *      Matthias Kovatsch <kovatsch@inf.ethz.ch>
  */
 
+#include <string.h>
 #include "er-coap-transactions.h"
 #include "er-coap-observe.h"
 #include "contiki-list.h"
@@ -65,12 +66,187 @@
 #endif
 
 /*---------------------------------------------------------------------------*/
-MEMB(transactions_memb, coap_transaction_t, COAP_MAX_OPEN_TRANSACTIONS);
-LIST(transactions_list);
+/* each engine worker has its own transaction pool and list, selected by coap_endpoint_shard() */
+static char transactions_memb_count[COAP_ENGINE_WORKERS][COAP_MAX_OPEN_TRANSACTIONS];
+static coap_transaction_t transactions_memb_mem[COAP_ENGINE_WORKERS][COAP_MAX_OPEN_TRANSACTIONS];
+static struct memb transactions_memb[COAP_ENGINE_WORKERS];
+static void *transactions_list[COAP_ENGINE_WORKERS];
+/* open addressing with linear probing, keyed by MID and endpoint */
+static coap_transaction_t *transactions_table[COAP_ENGINE_WORKERS][COAP_TRANSACTION_TABLE_SIZE];
+/* packet buffers shared by all workers, see buffer_shrink() */
+#if COAP_BUFFER_SMALL_SIZE >= COAP_BUFFER_MEDIUM_SIZE || COAP_BUFFER_MEDIUM_SIZE > COAP_MAX_PACKET_SIZE
+#error "Buffer size classes must grow towards COAP_MAX_PACKET_SIZE + 1"
+#endif
+typedef struct { uint8_t data[COAP_BUFFER_SMALL_SIZE]; } coap_small_buffer_t;
+typedef struct { uint8_t data[COAP_BUFFER_MEDIUM_SIZE]; } coap_medium_buffer_t;
+typedef struct { uint8_t data[COAP_MAX_PACKET_SIZE + 1]; } coap_large_buffer_t;
+MEMB(small_buffers, coap_small_buffer_t, COAP_BUFFER_SMALL_COUNT);
+MEMB(medium_buffers, coap_medium_buffer_t, COAP_BUFFER_MEDIUM_COUNT);
+MEMB(large_buffers, coap_large_buffer_t, COAP_BUFFER_LARGE_COUNT);
+static struct memb * const buffer_pools[] = { &small_buffers, &medium_buffers,
+		&large_buffers };
+#define BUFFER_POOLS  (sizeof(buffer_pools) / sizeof(buffer_pools[0]))
+/* CONs held back by NSTART, in the order they were sent */
+static coap_transaction_t *send_queue[COAP_ENGINE_WORKERS][COAP_MAX_OPEN_TRANSACTIONS];
+static uint8_t send_queue_len[COAP_ENGINE_WORKERS];
 static int initialized = 0;
 
 //static struct process *transaction_handler_process = NULL;
 
+/*---------------------------------------------------------------------------*/
+/*- Transaction table -------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+static unsigned int table_slot(uint16_t mid, ip_addr_t *addr, uint16_t port) {
+	uint32_t hash = addr->addr ^ ((uint32_t) port << 16 | mid);
+
+	hash *= 2654435761u;
+	return (hash >> 16) % COAP_TRANSACTION_TABLE_SIZE;
+}
+static int table_match(coap_transaction_t *t, uint16_t mid, ip_addr_t *addr,
+		uint16_t port) {
+	return t->mid == mid && t->port == port && ip_addr_cmp(&t->addr, addr);
+}
+/* call in a critical section */
+static void table_insert(coap_transaction_t *t) {
+	coap_transaction_t **table = transactions_table[t->shard];
+	unsigned int i = table_slot(t->mid, &t->addr, t->port);
+
+	while (table[i]) {
+		i = (i + 1) % COAP_TRANSACTION_TABLE_SIZE;
+	}
+	table[i] = t;
+}
+/* call in a critical section; shifts later entries of the probe run back so no tombstones are needed */
+static void table_remove(coap_transaction_t *t) {
+	coap_transaction_t **table = transactions_table[t->shard];
+	unsigned int i = table_slot(t->mid, &t->addr, t->port);
+	unsigned int j;
+	unsigned int home;
+
+	while (table[i] != t) {
+		if (table[i] == NULL) {
+			return;
+		}
+		i = (i + 1) % COAP_TRANSACTION_TABLE_SIZE;
+	}
+	table[i] = NULL;
+
+	for (j = (i + 1) % COAP_TRANSACTION_TABLE_SIZE; table[j];
+			j = (j + 1) % COAP_TRANSACTION_TABLE_SIZE) {
+		home = table_slot(table[j]->mid, &table[j]->addr, table[j]->port);
+		/* move the entry into the hole unless its home slot lies cyclically in (i, j] */
+		if ((j > i && (home <= i || home > j))
+				|| (j < i && (home <= i && home > j))) {
+			table[i] = table[j];
+			table[j] = NULL;
+			i = j;
+		}
+	}
+}
+/*---------------------------------------------------------------------------*/
+/*- Buffer pool -------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+/* call in a critical section; takes the smallest class that fits and has a free buffer */
+static uint8_t *buffer_alloc(uint16_t size, uint16_t *allocated) {
+	uint8_t *buffer;
+	unsigned int i;
+
+	for (i = 0; i < BUFFER_POOLS; ++i) {
+		if (buffer_pools[i]->size >= size
+				&& (buffer = memb_alloc(buffer_pools[i]))) {
+			*allocated = buffer_pools[i]->size;
+			return buffer;
+		}
+	}
+	return NULL;
+}
+/* call in a critical section */
+static void buffer_free(uint8_t *buffer) {
+	unsigned int i;
+
+	for (i = 0; i < BUFFER_POOLS; ++i) {
+		if (memb_inmemb(buffer_pools[i], buffer)) {
+			memb_free(buffer_pools[i], buffer);
+			return;
+		}
+	}
+}
+/*
+ * Transactions are built in a large buffer because the response length is
+ * only known after the handler ran. A CON is kept until it is acknowledged,
+ * so its datagram moves to the smallest class that holds it and the large
+ * buffer is free for the next response right away.
+ */
+static void buffer_shrink(coap_transaction_t *t) {
+	uint8_t *packet;
+	uint16_t packet_size;
+
+	taskENTER_CRITICAL();
+	packet = buffer_alloc(t->packet_len, &packet_size);
+	if (packet && packet_size >= t->packet_size) {
+		buffer_free(packet);
+		packet = NULL;
+	}
+	taskEXIT_CRITICAL();
+
+	if (packet) {
+		memcpy(packet, t->packet + t->packet_offset, t->packet_len);
+		taskENTER_CRITICAL();
+		buffer_free(t->packet);
+		taskEXIT_CRITICAL();
+		t->packet = packet;
+		t->packet_size = packet_size;
+		t->packet_offset = 0;
+	}
+}
+/*---------------------------------------------------------------------------*/
+/*- NSTART ------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+static int same_peer(coap_transaction_t *t, ip_addr_t *addr, uint16_t port) {
+	return t->port == port && ip_addr_cmp(&t->addr, addr);
+}
+/* call in a critical section */
+static int outstanding_count(coap_transaction_t *t) {
+	coap_transaction_t *o;
+	int n = 0;
+
+	for (o = (coap_transaction_t *) list_head(&transactions_list[t->shard]); o;
+			o = o->next) {
+		if (o->flow == COAP_TRANSACTION_OUTSTANDING
+				&& same_peer(o, &t->addr, t->port)) {
+			++n;
+		}
+	}
+	return n;
+}
+/* call in a critical section */
+static void queue_remove(unsigned int shard, int i) {
+	--send_queue_len[shard];
+	for (; i < send_queue_len[shard]; ++i) {
+		send_queue[shard][i] = send_queue[shard][i + 1];
+	}
+}
+/* sends the oldest CON queued for the peer once one of its outstanding ones completed */
+static void queue_release(unsigned int shard, ip_addr_t *addr, uint16_t port) {
+	coap_transaction_t *t = NULL;
+	int i;
+
+	taskENTER_CRITICAL();
+	for (i = 0; i < send_queue_len[shard]; ++i) {
+		if (same_peer(send_queue[shard][i], addr, port)) {
+			t = send_queue[shard][i];
+			t->flow = COAP_TRANSACTION_OUTSTANDING;
+			queue_remove(shard, i);
+			break;
+		}
+	}
+	taskEXIT_CRITICAL();
+
+	if (t) {
+		PRINTF("Releasing queued transaction %u\n", t->mid);
+		coap_send_transaction(t);
+	}
+}
 /*---------------------------------------------------------------------------*/
 /*- Internal API ------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
@@ -78,59 +254,176 @@ void coap_register_as_transaction_handler() {
 	//TODO
 //  transaction_handler_process = PROCESS_CURRENT();
 }
+static void coap_init_transactions(void) {
+	unsigned int i;
+
+	for (i = 0; i < COAP_ENGINE_WORKERS; ++i) {
+		transactions_memb[i].size = sizeof(coap_transaction_t);
+		transactions_memb[i].num = COAP_MAX_OPEN_TRANSACTIONS;
+		transactions_memb[i].count = transactions_memb_count[i];
+		transactions_memb[i].mem = transactions_memb_mem[i];
+		memb_init(&transactions_memb[i]);
+		list_init(&transactions_list[i]);
+	}
+	for (i = 0; i < BUFFER_POOLS; ++i) {
+		memb_init(buffer_pools[i]);
+	}
+	initialized = 1;
+}
 coap_transaction_t *
 coap_new_transaction(uint16_t mid, ip_addr_t *addr, uint16_t port) {
+	unsigned int shard = coap_endpoint_shard(addr, port);
+	coap_transaction_t *t;
+	uint8_t *packet = NULL;
+	uint16_t packet_size = 0;
+
+	/* separate responses and notifications may allocate from application tasks */
+	taskENTER_CRITICAL();
 	if (!initialized) {
-		memb_init(&transactions_memb);
-		list_init(transactions_list);
-		initialized = 1;
+		coap_init_transactions();
+	}
+	if ((t = memb_alloc(&transactions_memb[shard]))
+			&& (packet = buffer_alloc(COAP_MAX_PACKET_SIZE + 1, &packet_size))
+					== NULL) {
+		memb_free(&transactions_memb[shard], t);
+		t = NULL;
+	}
+	taskEXIT_CRITICAL();
+
+	if (t == NULL) {
+		COAP_STATS_INC(shard, pool_exhausted);
 	}
-	coap_transaction_t *t = memb_alloc(&transactions_memb);
 
 	if (t) {
+		t->shard = shard;
 		t->mid = mid;
 		t->retrans_counter = 0;
+		t->flow = COAP_TRANSACTION_IDLE;
+		t->pbuf = NULL;
+		t->packet = packet;
+		t->packet_size = packet_size;
+		t->packet_offset = 0;
+		t->created = xTaskGetTickCount();
+#if COAP_ADAPTIVE_RTO
+		t->retrans_interval = coap_rto_initial(addr, port, &t->retrans_backoff);
+#else
 		uint32_t wait_time = (COAP_RESPONSE_TIMEOUT
 				+ (rand() % COAP_RESPONSE_TIMEOUT_BACKOFF_MASK )) * 1000;
-		t->retrans_timer = xTimerCreate("retransmitTimer",
-				pdMS_TO_TICKS(wait_time), pdFALSE, t, coap_check_transactions);
+		t->retrans_interval = pdMS_TO_TICKS(wait_time);
+#endif
+		coap_timer_init(&t->retrans_timer, coap_check_transactions, t);
 		/* save client address */
 		ip_addr_copy(t->addr, *addr);
 		t->port = port;
 
-		list_add(transactions_list, t); /* list itself makes sure same element is not added twice */
+		taskENTER_CRITICAL();
+		list_add(&transactions_list[shard], t); /* list itself makes sure same element is not added twice */
+		table_insert(t);
+		taskEXIT_CRITICAL();
 	}
 
 	return t;
 }
 /*---------------------------------------------------------------------------*/
+/*
+ * Serializes packet into the transaction buffer. A payload written at
+ * t->packet + COAP_MAX_HEADER_SIZE stays in place and the datagram starts at
+ * t->packet + t->packet_offset.
+ */
+size_t coap_serialize_transaction(coap_transaction_t *t, void *packet) {
+	t->packet_len = coap_serialize_message_at(packet, t->packet,
+			t->packet_size, &t->addr, t->port, &t->packet_offset);
+	return t->packet_len;
+}
+/*---------------------------------------------------------------------------*/
+/* for a response that turns from piggybacked into a separate CON */
+void coap_set_transaction_mid(coap_transaction_t *t, uint16_t mid) {
+	taskENTER_CRITICAL();
+	table_remove(t);
+	t->mid = mid;
+	table_insert(t);
+	taskEXIT_CRITICAL();
+}
+/*---------------------------------------------------------------------------*/
 void coap_send_transaction(coap_transaction_t *t) {
+	int con = COAP_TYPE_CON
+			== ((COAP_HEADER_TYPE_MASK & t->packet[t->packet_offset])
+					>> COAP_HEADER_TYPE_POSITION);
+
 	PRINTF("Sending transaction %u\n", t->mid);
 
-	coap_send_message(&t->addr, t->port, t->packet, t->packet_len);
+	/* hold back new CONs while the peer already has COAP_NSTART outstanding */
+	if (con) {
+		int queued = 0;
+
+		if (t->flow == COAP_TRANSACTION_IDLE && t->pbuf == NULL) {
+			buffer_shrink(t);
+		}
+
+		taskENTER_CRITICAL();
+		if (t->flow == COAP_TRANSACTION_QUEUED) {
+			queued = 1;
+		} else if (t->flow == COAP_TRANSACTION_IDLE) {
+			if (outstanding_count(t) < COAP_NSTART) {
+				t->flow = COAP_TRANSACTION_OUTSTANDING;
+			} else {
+				t->flow = COAP_TRANSACTION_QUEUED;
+				send_queue[t->shard][send_queue_len[t->shard]++] = t;
+				queued = 1;
+			}
+		}
+		taskEXIT_CRITICAL();
+		if (queued) {
+			PRINTF("Queued transaction %u\n", t->mid);
+			COAP_STATS_INC(t->shard, queued);
+			return;
+		}
+	}
+
+	/* the pbuf only references t->packet, so retransmissions do not copy it again */
+	if (t->pbuf && t->pbuf->tot_len != t->packet_len) {
+		pbuf_free(t->pbuf);
+		t->pbuf = NULL;
+	}
+	if (t->pbuf == NULL) {
+		t->pbuf = pbuf_alloc(PBUF_RAW, t->packet_len, PBUF_REF);
+	}
+	if (t->pbuf) {
+		t->pbuf->payload = t->packet + t->packet_offset;
+		coap_send_pbuf(&t->addr, t->port, t->pbuf);
+		if (t->retrans_counter) {
+			COAP_STATS_INC(t->shard, retransmitted);
+		} else {
+			COAP_STATS_INC(t->shard, sent);
+		}
+	} else {
+		PRINTF("No pbuf for transaction %u\n", t->mid);
+	}
 
-	if (COAP_TYPE_CON
-			== ((COAP_HEADER_TYPE_MASK & t->packet[0])
-					>> COAP_HEADER_TYPE_POSITION)) {
+	if (con) {
 		if (t->retrans_counter < COAP_MAX_RETRANSMIT) {
 			/* not timed out yet */
 			PRINTF("Keeping transaction %u\n", t->mid);
 
 			if (t->retrans_counter == 0) {
-				xTimerStart(t->retrans_timer, 0); PRINTF("Initial interval %u\n",
-						(xTimerGetPeriod(t->retrans_timer)));
-
+				PRINTF("Initial interval %u\n", t->retrans_interval);
+				t->sent = xTaskGetTickCount();
 			} else {
-				TickType_t new_period = xTimerGetPeriod(t->retrans_timer) * 2;
-				xTimerChangePeriod(t->retrans_timer, new_period, 0);
-				xTimerStart(t->retrans_timer, 0); PRINTF("Doubled (%u) interval %u\n", t->retrans_counter,
-						xTimerGetPeriod(t->retrans_timer));
+#if COAP_ADAPTIVE_RTO
+				t->retrans_interval = t->retrans_interval * t->retrans_backoff / 2;
+#else
+				t->retrans_interval *= 2;
+#endif
+				PRINTF("Backed off (%u) interval %u\n", t->retrans_counter,
+						t->retrans_interval);
 			}
+			coap_timer_set(&t->retrans_timer, t->shard, t->retrans_interval);
 
 			t = NULL;
 		} else {
 			/* timed out */
 			PRINTF("Timeout\n");
+			COAP_STATS_INC(t->shard, timed_out);
 			restful_response_handler callback = t->callback;
 			void *callback_data = t->callback_data;
 
@@ -150,29 +443,104 @@ void coap_send_transaction(coap_transaction_t *t) {
 /*---------------------------------------------------------------------------*/
 void coap_clear_transaction(coap_transaction_t *t) {
 	if (t) {
+		unsigned int shard = t->shard;
+		int outstanding = t->flow == COAP_TRANSACTION_OUTSTANDING;
+		ip_addr_t addr;
+		uint16_t port = t->port;
+		int i;
+
 		PRINTF("Freeing transaction %u: %p\n", t->mid, t);
+		ip_addr_copy(addr, t->addr);
+		coap_stats_record(coap_stats_shard[shard].time_in_pool,
+				xTaskGetTickCount() - t->created);
 
-		xTimerDelete(t->retrans_timer, 0);
-		list_remove(transactions_list, t);
-		memb_free(&transactions_memb, t);
+		coap_timer_stop(&t->retrans_timer);
+		if (t->pbuf) {
+			pbuf_free(t->pbuf);
+		}
+		taskENTER_CRITICAL();
+		if (t->flow == COAP_TRANSACTION_QUEUED) {
+			for (i = 0; send_queue[shard][i] != t; ++i)
+				;
+			queue_remove(shard, i);
+		}
+		table_remove(t);
+		buffer_free(t->packet);
+		list_remove(&transactions_list[shard], t);
+		memb_free(&transactions_memb[shard], t);
+		taskEXIT_CRITICAL();
+
+		if (outstanding) {
+			queue_release(shard, &addr, port);
+		}
 	}
 }
+/*
+ * Finds the transaction of a peer by MID; two peers may use the same MID at
+ * the same time.
+ */
+coap_transaction_t *
+coap_get_transaction(uint16_t mid, ip_addr_t *addr, uint16_t port) {
+	coap_transaction_t **table;
+	coap_transaction_t *t = NULL;
+	unsigned int i;
+
+	if (!initialized) {
+		return NULL;
+	}
+	table = transactions_table[coap_endpoint_shard(addr, port)];
+
+	taskENTER_CRITICAL();
+	for (i = table_slot(mid, addr, port); table[i];
+			i = (i + 1) % COAP_TRANSACTION_TABLE_SIZE) {
+		if (table_match(table[i], mid, addr, port)) {
+			t = table[i];
+			break;
+		}
+	}
+	taskEXIT_CRITICAL();
+
+	PRINTF("Found transaction for MID %u: %p\n", mid, t);
+	return t;
+}
 coap_transaction_t *
 coap_get_transaction_by_mid(uint16_t mid) {
 	coap_transaction_t *t = NULL;
+	int i;
 
-	for (t = (coap_transaction_t *) list_head(transactions_list); t; t =
-			t->next) {
-		if (t->mid == mid) {
-			PRINTF("Found transaction for MID %u: %p\n", t->mid, t);
-			return t;
+	if (!initialized) {
+		return NULL;
+	}
+	for (i = 0; i < COAP_ENGINE_WORKERS; ++i) {
+		for (t = (coap_transaction_t *) list_head(&transactions_list[i]); t;
+				t = t->next) {
+			if (t->mid == mid) {
+				PRINTF("Found transaction for MID %u: %p\n", t->mid, t);
+				return t;
+			}
 		}
 	}
 	return NULL;
 }
+/* number of CONs to the peer waiting for NSTART */
+int coap_get_queue_depth(ip_addr_t *addr, uint16_t port) {
+	unsigned int shard = coap_endpoint_shard(addr, port);
+	int depth = 0;
+	int i;
+
+	taskENTER_CRITICAL();
+	for (i = 0; i < send_queue_len[shard]; ++i) {
+		if (same_peer(send_queue[shard][i], addr, port)) {
+			++depth;
+		}
+	}
+	taskEXIT_CRITICAL();
+	return depth;
+}
 /*---------------------------------------------------------------------------*/
-void coap_check_transactions(TimerHandle_t xTimer) {
-	coap_transaction_t *t = (coap_transaction_t *) pvTimerGetTimerID(xTimer);
+/* retransmission timer callback, runs in the engine worker owning the transaction */
+void coap_check_transactions(void *data) {
+	coap_transaction_t *t = (coap_transaction_t *) data;
 	++(t->retrans_counter);
 	PRINTF("Retransmitting %u (%u)\n", t->mid, t->retrans_counter);
 	coap_send_transaction(t);
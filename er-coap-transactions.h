@@ -40,6 +40,9 @@
 #define COAP_TRANSACTIONS_H_
 #include "porting.h"
 #include "er-coap.h"
+#include "er-coap-timer.h"
+#include "er-coap-rto.h"
+#include "er-coap-stats.h"
 
 /*
  * Modulo mask (thus +1) for a random number to get the tick number for the random
@@ -47,13 +50,26 @@
  */
 #define COAP_RESPONSE_TIMEOUT_BACKOFF_MASK  (long)((COAP_RESPONSE_TIMEOUT * ((float)COAP_RESPONSE_RANDOM_FACTOR - 1.0)) + 0.5) + 1
 
+/* NSTART state of a transaction */
+#define COAP_TRANSACTION_IDLE         0 /* not sent yet, or not a CON */
+#define COAP_TRANSACTION_QUEUED       1 /* waiting for another CON to the peer to complete */
+#define COAP_TRANSACTION_OUTSTANDING  2 /* sent and waiting for the ACK */
+
 /* container for transactions with message buffer and retransmission info */
 typedef struct coap_transaction {
   struct coap_transaction *next;        /* for LIST */
 
   uint16_t mid;
-  TimerHandle_t retrans_timer;
+  uint8_t shard;                /* engine worker owning the pool the transaction came from */
+  coap_timer_t retrans_timer;
+  TickType_t retrans_interval;
   uint8_t retrans_counter;
+  uint8_t flow;                 /* COAP_TRANSACTION_IDLE, _QUEUED or _OUTSTANDING */
+#if COAP_ADAPTIVE_RTO
+  uint8_t retrans_backoff;      /* interval factor in halves, see coap_rto_initial() */
+#endif
+  TickType_t created;           /* for the time-in-pool statistics */
+  TickType_t sent;              /* first transmission, for the RTT sample */
 
   ip_addr_t addr;
   uint16_t port;
@@ -61,19 +77,29 @@ typedef struct coap_transaction {
   restful_response_handler callback;
   void *callback_data;
 
+  struct pbuf *pbuf;     /* PBUF_REF to packet, allocated on first send and reused for retransmissions */
+  uint16_t packet_offset;       /* start of the datagram within packet, see coap_serialize_transaction() */
   uint16_t packet_len;
-  uint8_t packet[COAP_MAX_PACKET_SIZE + 1];     /* +1 for the terminating '\0' which will not be sent
-                                                 * Use snprintf(buf, len+1, "", ...) to completely fill payload */
+
+  uint8_t *packet;              /* from the buffer pool, COAP_MAX_PACKET_SIZE + 1 bytes until a CON is sent the first time
+                                 * +1 for the terminating '\0' which will not be sent
+                                 * Use snprintf(buf, len+1, "", ...) to completely fill payload */
+  uint16_t packet_size;
 } coap_transaction_t;
 
 void coap_register_as_transaction_handler(void);
 
 coap_transaction_t *coap_new_transaction(uint16_t mid, ip_addr_t *addr,
                                          uint16_t port);
+size_t coap_serialize_transaction(coap_transaction_t *t, void *packet);
+void coap_set_transaction_mid(coap_transaction_t *t, uint16_t mid);
 void coap_send_transaction(coap_transaction_t *t);
 void coap_clear_transaction(coap_transaction_t *t);
+coap_transaction_t *coap_get_transaction(uint16_t mid, ip_addr_t *addr,
+                                         uint16_t port);
 coap_transaction_t *coap_get_transaction_by_mid(uint16_t mid);
+int coap_get_queue_depth(ip_addr_t *addr, uint16_t port);
 
-void coap_check_transactions(TimerHandle_t xTimer);
+void coap_check_transactions(void *data);
 
 #endif /* COAP_TRANSACTIONS_H_ */
@@ -40,6 +40,7 @@
 #include <stdio.h>
 #include "er-coap.h"
 #include "er-coap-transactions.h"
+#include "memb.h"
 
 #define COAP_DEBUG 0
 #if COAP_DEBUG
@@ -68,10 +69,27 @@
 /*- Variables ---------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 static struct udp_pcb *udp_conn = NULL;
-static uint16_t current_mid = 0;
 QueueHandle_t *receivequeue_ptr;
+QueueHandle_t coap_receive_queues[COAP_ENGINE_WORKERS];
+#if COAP_ENGINE_WORKERS > 1
+/* used by tasks that are not engine workers, e.g., timers and the application */
+static coap_context_t default_context = { NO_ERROR, "" };
+#else
 coap_status_t erbium_status_code = NO_ERROR;
 char *coap_error_message = "";
+#endif
+
+MEMB(shared_buffers_memb, coap_shared_buffer_t, COAP_MAX_SHARED_BUFFERS);
+
+#if LWIP_SUPPORT_CUSTOM_PBUF
+/* pbuf that keeps a reference to the shared buffer it points into */
+typedef struct {
+	struct pbuf_custom pc;
+	coap_shared_buffer_t *shared;
+} coap_shared_pbuf_t;
+
+MEMB(shared_pbufs_memb, coap_shared_pbuf_t, COAP_MAX_SHARED_PBUFS);
+#endif
 
 /*---------------------------------------------------------------------------*/
 /*- Local helper functions --------------------------------------------------*/
@@ -98,6 +116,99 @@ static uint32_t coap_parse_int_option(uint8_t *bytes, size_t length) {
 	return var;
 }
 /*---------------------------------------------------------------------------*/
+static void coap_decode_option(coap_packet_t *coap_pkt, unsigned int number,
+		uint8_t *value, size_t length) {
+	switch (number) {
+	case COAP_OPTION_CONTENT_FORMAT:
+		coap_pkt->content_format = coap_parse_int_option(value, length);
+		PRINTF("Content-Format [%u]\n", coap_pkt->content_format);
+		break;
+	case COAP_OPTION_MAX_AGE:
+		coap_pkt->max_age = coap_parse_int_option(value, length);
+		PRINTF("Max-Age [%lu]\n", (unsigned long )coap_pkt->max_age);
+		break;
+	case COAP_OPTION_ETAG:
+		coap_pkt->etag_len = MIN(COAP_ETAG_LEN, length);
+		memcpy(coap_pkt->etag, value, coap_pkt->etag_len);
+		PRINTF("ETag %u [0x%02X%02X%02X%02X%02X%02X%02X%02X]\n",
+				coap_pkt->etag_len, coap_pkt->etag[0], coap_pkt->etag[1],
+				coap_pkt->etag[2], coap_pkt->etag[3], coap_pkt->etag[4],
+				coap_pkt->etag[5], coap_pkt->etag[6], coap_pkt->etag[7]); /*FIXME always prints 8 bytes */
+		break;
+	case COAP_OPTION_ACCEPT:
+		coap_pkt->accept = coap_parse_int_option(value, length);
+		PRINTF("Accept [%u]\n", coap_pkt->accept);
+		break;
+	case COAP_OPTION_IF_MATCH:
+		/* TODO support multiple ETags */
+		coap_pkt->if_match_len = MIN(COAP_ETAG_LEN, length);
+		memcpy(coap_pkt->if_match, value, coap_pkt->if_match_len);
+		PRINTF("If-Match %u [0x%02X%02X%02X%02X%02X%02X%02X%02X]\n",
+				coap_pkt->if_match_len, coap_pkt->if_match[0],
+				coap_pkt->if_match[1], coap_pkt->if_match[2],
+				coap_pkt->if_match[3], coap_pkt->if_match[4],
+				coap_pkt->if_match[5], coap_pkt->if_match[6],
+				coap_pkt->if_match[7]); /* FIXME always prints 8 bytes */
+		break;
+	case COAP_OPTION_URI_PORT:
+		coap_pkt->uri_port = coap_parse_int_option(value, length);
+		PRINTF("Uri-Port [%u]\n", coap_pkt->uri_port);
+		break;
+	case COAP_OPTION_OBSERVE:
+		coap_pkt->observe = coap_parse_int_option(value, length);
+		PRINTF("Observe [%lu]\n", (unsigned long )coap_pkt->observe);
+		break;
+	case COAP_OPTION_BLOCK2:
+		coap_pkt->block2_num = coap_parse_int_option(value, length);
+		coap_pkt->block2_more = (coap_pkt->block2_num & 0x08) >> 3;
+		coap_pkt->block2_size = 16 << (coap_pkt->block2_num & 0x07);
+		coap_pkt->block2_offset = (coap_pkt->block2_num & ~0x0000000F)
+				<< (coap_pkt->block2_num & 0x07);
+		coap_pkt->block2_num >>= 4;
+		PRINTF("Block2 [%lu%s (%u B/blk)]\n",
+				(unsigned long )coap_pkt->block2_num,
+				coap_pkt->block2_more ? "+" : "", coap_pkt->block2_size);
+		break;
+	case COAP_OPTION_BLOCK1:
+		coap_pkt->block1_num = coap_parse_int_option(value, length);
+		coap_pkt->block1_more = (coap_pkt->block1_num & 0x08) >> 3;
+		coap_pkt->block1_size = 16 << (coap_pkt->block1_num & 0x07);
+		coap_pkt->block1_offset = (coap_pkt->block1_num & ~0x0000000F)
+				<< (coap_pkt->block1_num & 0x07);
+		coap_pkt->block1_num >>= 4;
+		PRINTF("Block1 [%lu%s (%u B/blk)]\n",
+				(unsigned long )coap_pkt->block1_num,
+				coap_pkt->block1_more ? "+" : "", coap_pkt->block1_size);
+		break;
+	case COAP_OPTION_SIZE2:
+		coap_pkt->size2 = coap_parse_int_option(value, length);
+		PRINTF("Size2 [%lu]\n", (unsigned long )coap_pkt->size2);
+		break;
+	case COAP_OPTION_SIZE1:
+		coap_pkt->size1 = coap_parse_int_option(value, length);
+		PRINTF("Size1 [%lu]\n", (unsigned long )coap_pkt->size1);
+		break;
+	}
+}
+/*---------------------------------------------------------------------------*/
+static void coap_resolve_option(coap_packet_t *coap_pkt, unsigned int number) {
+	int i;
+
+	if (!IS_PENDING(coap_pkt, number)) {
+		return;
+	}
+	/* repeated options are indexed in order, the last one wins as in eager parsing */
+	for (i = 0; i < coap_pkt->option_index_len; ++i) {
+		if (coap_pkt->option_index[i].number == number) {
+			coap_decode_option(coap_pkt, number,
+					coap_pkt->buffer + coap_pkt->option_index[i].offset,
+					coap_pkt->option_index[i].length);
+		}
+	}
+	coap_pkt->pending[number / OPTION_MAP_SIZE] &= ~(1
+			<< (number % OPTION_MAP_SIZE));
+}
+/*---------------------------------------------------------------------------*/
 static uint8_t coap_option_nibble(unsigned int value) {
 	if (value < 13) {
 		return value;
@@ -216,25 +327,151 @@ static size_t coap_serialize_array_option(unsigned int number,
 	return i;
 }
 /*---------------------------------------------------------------------------*/
-static void coap_merge_multi_option(char **dst, size_t *dst_len,
-		uint8_t *option, size_t option_len, char separator) {
-	/* merge multiple options */
-	if (*dst_len > 0) {
-		/* dst already contains an option: concatenate */
-		(*dst)[*dst_len] = separator;
-		*dst_len += 1;
-
-		/* memmove handles 2-byte option headers */
-		memmove((*dst) + (*dst_len), option, option_len);
-
-		*dst_len += option_len;
+/* decodes the extended delta or length bytes for the nibble values 13 and 14 */
+static uint8_t *coap_parse_option_extended(uint8_t *option,
+		const uint8_t *end, unsigned int nibble, unsigned int *value) {
+	*value = nibble;
+
+	if (nibble == 13) {
+		if (end - option < 1) {
+			return NULL;
+		}
+		*value += option[0];
+		++option;
+	} else if (nibble == 14) {
+		if (end - option < 2) {
+			return NULL;
+		}
+		*value += 255;
+		*value += option[0] << 8;
+		*value += option[1];
+		option += 2;
+	}
+
+	return option;
+}
+/*
+ * Decodes the option header at option and returns a pointer to the value.
+ * Returns NULL if the header uses the reserved nibble 15 or if the extended
+ * bytes or the value run past end.
+ */
+static uint8_t *coap_parse_option_header(uint8_t *option, const uint8_t *end,
+		unsigned int *delta, size_t *length) {
+	unsigned int nibble_delta;
+	unsigned int nibble_length;
+	unsigned int value_length;
+
+	if (option >= end) {
+		return NULL;
+	}
+
+	nibble_delta = option[0] >> 4;
+	nibble_length = option[0] & 0x0F;
+	++option;
+
+	if (nibble_delta == 15 || nibble_length == 15) {
+		return NULL;
+	}
+
+	option = coap_parse_option_extended(option, end, nibble_delta, delta);
+	if (option == NULL) {
+		return NULL;
+	}
+	option = coap_parse_option_extended(option, end, nibble_length,
+			&value_length);
+	if (option == NULL || (size_t) (end - option) < value_length) {
+		return NULL;
+	}
+	*length = value_length;
+
+	return option;
+}
+/*---------------------------------------------------------------------------*/
+static coap_option_segments_t *coap_get_segments(coap_packet_t *coap_pkt,
+		unsigned int number, const char ***view, size_t **view_len,
+		char *separator) {
+	switch (number) {
+	case COAP_OPTION_URI_PATH:
+		*view = &coap_pkt->uri_path;
+		*view_len = &coap_pkt->uri_path_len;
+		*separator = '/';
+		return &coap_pkt->uri_path_segments;
+	case COAP_OPTION_URI_QUERY:
+		*view = &coap_pkt->uri_query;
+		*view_len = &coap_pkt->uri_query_len;
+		*separator = '&';
+		return &coap_pkt->uri_query_segments;
+	case COAP_OPTION_LOCATION_PATH:
+		*view = &coap_pkt->location_path;
+		*view_len = &coap_pkt->location_path_len;
+		*separator = '/';
+		return &coap_pkt->location_path_segments;
+	case COAP_OPTION_LOCATION_QUERY:
+		*view = &coap_pkt->location_query;
+		*view_len = &coap_pkt->location_query_len;
+		*separator = '&';
+		return &coap_pkt->location_query_segments;
+	default:
+		return NULL;
+	}
+}
+/*---------------------------------------------------------------------------*/
+static void coap_add_segment(coap_packet_t *coap_pkt, unsigned int number,
+		uint8_t *header, uint8_t *option, size_t option_len) {
+	const char **view;
+	size_t *view_len;
+	char separator;
+	coap_option_segments_t *segments = coap_get_segments(coap_pkt, number,
+			&view, &view_len, &separator);
+
+	if (!IS_OPTION(coap_pkt, number)) {
+		/* first segment: the view points to it in-place until a merge is requested */
+		SET_OPTION(coap_pkt, number);
+		segments->start = header;
+		segments->count = 1;
+		*view = (const char *) option;
+		*view_len = option_len;
 	} else {
-		/* dst is empty: set to option */
-		*dst = (char *) option;
-		*dst_len = option_len;
+		/* repeated options are consecutive, so counting them is enough for iteration */
+		++segments->count;
 	}
 }
 /*---------------------------------------------------------------------------*/
+/*
+ * Merges the segments into the datagram, starting at the first value. Every
+ * option header takes at least the byte its separator needs, so the string
+ * fits and writing never overtakes the header read next. The headers are
+ * gone afterwards and iteration splits the string instead.
+ */
+static void coap_merge_view(coap_packet_t *coap_pkt, unsigned int number) {
+	const char **view;
+	size_t *view_len;
+	char separator;
+	coap_option_segments_t *segments = coap_get_segments(coap_pkt, number,
+			&view, &view_len, &separator);
+	coap_option_iter_t iter;
+	const uint8_t *segment;
+	int segment_len;
+	char *merged = (char *) *view;
+	size_t len = 0;
+
+	if (segments->start == NULL || segments->count < 2) {
+		return;
+	}
+
+	coap_option_iter_init(coap_pkt, number, &iter);
+	while ((segment_len = coap_option_iter_next(&iter, &segment)) >= 0) {
+		if (len > 0) {
+			merged[len++] = separator;
+		}
+		memmove(merged + len, segment, segment_len);
+		len += segment_len;
+	}
+
+	*view_len = len;
+	segments->start = NULL;
+}
+/*---------------------------------------------------------------------------*/
 static int coap_get_variable(const char *buffer, size_t length,
 		const char *name, const char **output) {
 	const char *start = NULL;
@@ -283,51 +520,85 @@ void receive_datagram(void *arg, struct udp_pcb *pcb, struct pbuf *p,
 	datagram.addr = *addr;
 	datagram.port = port;
 	PRINTF("Before Queue send\n");
-	xQueueSend(*receivequeue_ptr, &datagram, 0);
+	/* the same peer always goes to the same worker to keep its MID and Observe order */
+	if (xQueueSend(coap_receive_queues[coap_endpoint_shard(addr, port)],
+			&datagram, 0) != pdPASS) {
+		PRINTF("Receive queue full, dropping datagram\n");
+		pbuf_free(p);
+		return;
+	}
 	PRINTF("Queue send\n");
 }
+/*---------------------------------------------------------------------------*/
+/* wakes a worker blocked on its queue, e.g., to rearm its timeout */
+void coap_kick_worker(unsigned int shard) {
+	received_item_t kick;
+
+	kick.p = NULL;
+	xQueueSend(coap_receive_queues[shard], &kick, 0);
+}
+/*---------------------------------------------------------------------------*/
+unsigned int coap_endpoint_shard(ip_addr_t *addr, uint16_t port) {
+#if COAP_ENGINE_WORKERS > 1
+	uint32_t hash = addr->addr ^ ((uint32_t) port << 16 | port);
+
+	hash *= 2654435761u; /* Knuth's multiplicative hash */
+	return (hash >> 16) % COAP_ENGINE_WORKERS;
+#else
+	(void) addr;
+	(void) port;
+	return 0;
+#endif
+}
+#if COAP_ENGINE_WORKERS > 1
+/*---------------------------------------------------------------------------*/
+coap_context_t *coap_get_context(void) {
+	coap_context_t *context = pvTaskGetThreadLocalStoragePointer(NULL,
+			COAP_CONTEXT_TLS_INDEX);
+
+	return context ? context : &default_context;
+}
+void coap_set_context(coap_context_t *context) {
+	vTaskSetThreadLocalStoragePointer(NULL, COAP_CONTEXT_TLS_INDEX, context);
+}
+#endif
 
 void coap_init_connection(uint16_t port) {
 	/* new connection with remote host */
 	udp_conn = udp_new();
 	udp_bind(udp_conn, IP_ADDR_ANY, port);
-	/* initialize transaction ID */
-	current_mid = rand();
+	/* initialize MID counters and token generator */
+	coap_init_ids();
 	udp_recv(udp_conn, receive_datagram, NULL);
 }
 /*---------------------------------------------------------------------------*/
-uint16_t coap_get_mid() {
-	return ++current_mid;
-}
-/*---------------------------------------------------------------------------*/
 void coap_init_message(void *packet, coap_message_type_t type, uint8_t code,
 		uint16_t mid) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
 	/* Important thing */
-	memset(coap_pkt, 0, sizeof(coap_packet_t));
+	memset(coap_pkt, 0, offsetof(coap_packet_t, option_index));
 
 	coap_pkt->type = type;
 	coap_pkt->code = code;
 	coap_pkt->mid = mid;
 }
 /*---------------------------------------------------------------------------*/
-size_t coap_serialize_message(void *packet, uint8_t *buffer, ip_addr_t *addr,
-		uint16_t port) {
-	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+/*
+ * Writes header, token, options, and the payload marker to buffer.
+ * Returns the header length including the marker, or 0 on error.
+ */
+static size_t coap_serialize_header(coap_packet_t *coap_pkt, uint8_t *buffer) {
 	uint8_t *option;
 	unsigned int current_number = 0;
 
 	/* Initialize */
-	ip_addr_copy(coap_pkt->addr, *addr);
-	coap_pkt->port = port;
 	coap_pkt->buffer = buffer;
 	coap_pkt->version = 1;
 
 	PRINTF("-Serializing MID %u to %p, ", coap_pkt->mid, coap_pkt->buffer);
 	PRINT4ADDR(&coap_pkt->addr);
-	PRINT4ADDR(addr);
-	PRINTF("addr printed\n");
+	PRINTF("\n");
 	/* set header fields */
 	coap_pkt->buffer[0] = 0x00;
 	coap_pkt->buffer[0] |= COAP_HEADER_VERSION_MASK
@@ -393,17 +664,21 @@ size_t coap_serialize_message(void *packet, uint8_t *buffer, ip_addr_t *addr,
 	COAP_SERIALIZE_STRING_OPTION(COAP_OPTION_PROXY_SCHEME, proxy_scheme, '\0',
 			"Proxy-Scheme");
 	COAP_SERIALIZE_INT_OPTION(COAP_OPTION_SIZE1, size1, "Size1");
+	if (coap_pkt->no_response) {
+		PRINTF("No-Response [%u]\n", coap_pkt->no_response);
+		option += coap_serialize_int_option(COAP_OPTION_NO_RESPONSE,
+				current_number, option, coap_pkt->no_response);
+		current_number = COAP_OPTION_NO_RESPONSE;
+	}
 
 	PRINTF("-Done serializing at %p----\n", option);
 
-	/* Pack payload */
+	/* Payload marker */
 	if ((option - coap_pkt->buffer) <= COAP_MAX_HEADER_SIZE) {
-		/* Payload marker */
 		if (coap_pkt->payload_len) {
 			*option = 0xFF;
 			++option;
 		}
-		memmove(option, coap_pkt->payload, coap_pkt->payload_len);
 	} else {
 		/* an error occurred: caller must check for !=0 */
 		coap_pkt->buffer = NULL;
@@ -411,42 +686,210 @@ size_t coap_serialize_message(void *packet, uint8_t *buffer, ip_addr_t *addr,
 		return 0;
 	}
 
-	PRINTF("-Done %u B (header len %u, payload len %u)-\n",
-			(unsigned int )(coap_pkt->payload_len + option - buffer),
+	PRINTF("-Done header %u B (payload len %u)-\n",
 			(unsigned int )(option - buffer),
 			(unsigned int )coap_pkt->payload_len);
 
+	return option - buffer;
+}
+size_t coap_serialize_message(void *packet, uint8_t *buffer, ip_addr_t *addr,
+		uint16_t port) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+	size_t header_len;
+
+	ip_addr_copy(coap_pkt->addr, *addr);
+	coap_pkt->port = port;
+
+	header_len = coap_serialize_header(coap_pkt, buffer);
+	if (header_len == 0 || !coap_pkt->code) {
+		return header_len;
+	}
+
+	/* Pack payload */
+	if (coap_pkt->payload_len) {
+		memmove(buffer + header_len, coap_pkt->payload, coap_pkt->payload_len);
+	}
+
 	PRINTF("Dump [0x%02X %02X %02X %02X  %02X %02X %02X %02X]\n",
 			coap_pkt->buffer[0], coap_pkt->buffer[1], coap_pkt->buffer[2],
 			coap_pkt->buffer[3], coap_pkt->buffer[4], coap_pkt->buffer[5],
 			coap_pkt->buffer[6], coap_pkt->buffer[7]);
 
-	return (option - buffer) + coap_pkt->payload_len; /* packet length */
+	return header_len + coap_pkt->payload_len; /* packet length */
+}
+/*
+ * Like coap_serialize_message(), but leaves a payload that was written into
+ * buffer behind the reserved header space (e.g., at COAP_MAX_HEADER_SIZE) in
+ * place and moves the header up to end flush against it instead. The
+ * datagram then starts at buffer + *offset. Payloads elsewhere are copied
+ * behind the header as usual and *offset is 0. Returns 0 if the datagram
+ * does not fit into the buffer_len bytes of buffer.
+ */
+size_t coap_serialize_message_at(void *packet, uint8_t *buffer,
+		uint16_t buffer_len, ip_addr_t *addr, uint16_t port, uint16_t *offset) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+	size_t header_len;
+
+	*offset = 0;
+	ip_addr_copy(coap_pkt->addr, *addr);
+	coap_pkt->port = port;
+
+	header_len = coap_serialize_header(coap_pkt, buffer);
+	if (header_len == 0 || !coap_pkt->code) {
+		return header_len;
+	}
+
+	if (coap_pkt->payload_len && coap_pkt->payload >= buffer + header_len
+			&& coap_pkt->payload + coap_pkt->payload_len <= buffer + buffer_len) {
+		/* only the header moves, at most COAP_MAX_HEADER_SIZE bytes */
+		*offset = coap_pkt->payload - header_len - buffer;
+		memmove(buffer + *offset, buffer, header_len);
+		coap_pkt->buffer = buffer + *offset;
+	} else if (header_len + coap_pkt->payload_len > buffer_len) {
+		PRINTF("Serialized message too large for %u B buffer\n", buffer_len);
+		return 0;
+	} else if (coap_pkt->payload_len) {
+		memmove(buffer + header_len, coap_pkt->payload, coap_pkt->payload_len);
+	}
+
+	return header_len + coap_pkt->payload_len; /* packet length */
 }
 /*---------------------------------------------------------------------------*/
-void coap_send_message(ip_addr_t *addr, uint16_t port, uint8_t *data,
-		uint16_t length) {
+void coap_send_pbuf(ip_addr_t *addr, uint16_t port, struct pbuf *p) {
 	if (udp_conn == NULL)
 		PRINTF("[ERROR] null udp_conn\n");
 
+	/* lwIP chains its own header pbuf in front and takes a reference to p */
+	if (udp_sendto(udp_conn, p, addr, port) == ERR_OK) {
+		PRINTF("-sent UDP datagram (%u)-\n", p->tot_len);
+	}
+}
+/*---------------------------------------------------------------------------*/
+void coap_send_message(ip_addr_t *addr, uint16_t port, uint8_t *data,
+		uint16_t length) {
+	/*
+	 * One-shot messages live on the caller's stack or in evictable caches,
+	 * so they are copied: a netif may still queue the pbuf after the call.
+	 * Transactions reference their own buffer, see coap_send_transaction().
+	 */
 	struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, length, PBUF_RAM);
 
-	if (pbuf_take(p, data, length) == ERR_OK) {
-		udp_sendto(udp_conn, p, addr, port);
-		PRINTF("-sent UDP datagram (%u)-\n", length);
+	if (p == NULL || pbuf_take(p, data, length) != ERR_OK) {
+		PRINTF("[ERROR] no pbuf for UDP datagram\n");
+		if (p) {
+			pbuf_free(p);
+		}
+		return;
 	}
+	coap_send_pbuf(addr, port, p);
 	pbuf_free(p);
-
 }
 /*---------------------------------------------------------------------------*/
-coap_status_t coap_parse_message(void *packet, uint8_t *data, uint16_t data_len) {
+coap_shared_buffer_t *coap_alloc_shared_buffer(void) {
+	coap_shared_buffer_t *buffer;
+
+	taskENTER_CRITICAL();
+	buffer = memb_alloc(&shared_buffers_memb);
+	if (buffer) {
+		buffer->refs = 1;
+		buffer->len = 0;
+	}
+	taskEXIT_CRITICAL();
+	return buffer;
+}
+void coap_ref_shared_buffer(coap_shared_buffer_t *buffer) {
+	taskENTER_CRITICAL();
+	++(buffer->refs);
+	taskEXIT_CRITICAL();
+}
+void coap_release_shared_buffer(coap_shared_buffer_t *buffer) {
+	if (buffer == NULL) {
+		return;
+	}
+	taskENTER_CRITICAL();
+	if (--(buffer->refs) == 0) {
+		memb_free(&shared_buffers_memb, buffer);
+	}
+	taskEXIT_CRITICAL();
+}
+#if LWIP_SUPPORT_CUSTOM_PBUF
+static void coap_free_shared_pbuf(struct pbuf *p) {
+	coap_shared_pbuf_t *sp = (coap_shared_pbuf_t *) p;
+	coap_shared_buffer_t *buffer = sp->shared;
+
+	taskENTER_CRITICAL();
+	memb_free(&shared_pbufs_memb, sp);
+	taskEXIT_CRITICAL();
+	coap_release_shared_buffer(buffer);
+}
+#endif
+/*
+ * Returns a pbuf holding len bytes of the shared buffer from offset. lwIP may
+ * queue it past the send call, so it either references the buffer until lwIP
+ * frees it or, when no custom pbuf is available, carries a copy.
+ */
+struct pbuf *coap_shared_buffer_pbuf(coap_shared_buffer_t *buffer,
+		uint16_t offset, uint16_t len) {
+	struct pbuf *p;
+#if LWIP_SUPPORT_CUSTOM_PBUF
+	coap_shared_pbuf_t *sp;
+
+	taskENTER_CRITICAL();
+	sp = memb_alloc(&shared_pbufs_memb);
+	taskEXIT_CRITICAL();
+	if (sp) {
+		sp->shared = buffer;
+		sp->pc.custom_free_function = coap_free_shared_pbuf;
+		coap_ref_shared_buffer(buffer);
+		return pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &sp->pc,
+				buffer->data + offset, len);
+	}
+#endif
+	if ((p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM)) != NULL) {
+		pbuf_take(p, buffer->data + offset, len);
+	}
+	return p;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Parses the datagram in data. If chained, the datagram continues in another
+ * buffer, so an option running past data_len does not fit the first buffer
+ * instead of being truncated, and the payload may start right after it.
+ */
+static coap_status_t coap_parse_buffer(void *packet, uint8_t *data,
+		uint16_t data_len, int chained) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
-	/* initialize packet */
-	memset(coap_pkt, 0, sizeof(coap_packet_t));
+	/*
+	 * Initialize packet: only the fields the parser relies on are cleared.
+	 * Option values are indexed and decoded on first access through the getters.
+	 */
+	memset(coap_pkt->options, 0, sizeof(coap_pkt->options));
+	memset(coap_pkt->pending, 0, sizeof(coap_pkt->pending));
+	coap_pkt->option_index_len = 0;
+	coap_pkt->uri_path_len = 0;
+	coap_pkt->uri_query_len = 0;
+	coap_pkt->location_path_len = 0;
+	coap_pkt->location_query_len = 0;
+	coap_pkt->uri_path_segments.start = NULL;
+	coap_pkt->uri_query_segments.start = NULL;
+	coap_pkt->location_path_segments.start = NULL;
+	coap_pkt->location_query_segments.start = NULL;
+	coap_pkt->no_response = 0;
+	coap_pkt->payload = NULL;
+	coap_pkt->payload_len = 0;
+	coap_pkt->payload_pbuf = NULL;
+	coap_pkt->payload_cursor = 0;
 
 	/* pointer to packet bytes */
 	coap_pkt->buffer = data;
+	coap_pkt->buffer_len = data_len;
+
+	if (data_len < COAP_HEADER_LEN) {
+		/* nothing to answer to, silently drop the datagram */
+		coap_error_message = "Message shorter than header";
+		return MANUAL_RESPONSE;
+	}
 
 	/* parse header fields */
 	coap_pkt->version = (COAP_HEADER_VERSION_MASK & coap_pkt->buffer[0])
@@ -468,6 +911,11 @@ coap_status_t coap_parse_message(void *packet, uint8_t *data, uint16_t data_len)
 		return BAD_REQUEST_4_00;
 	}
 
+	if (data_len < COAP_HEADER_LEN + coap_pkt->token_len) {
+		coap_error_message = "Token exceeds message";
+		return BAD_REQUEST_4_00;
+	}
+
 	uint8_t *current_option = data + COAP_HEADER_LEN;
 
 	memcpy(coap_pkt->token, current_option, coap_pkt->token_len);
@@ -477,53 +925,47 @@ coap_status_t coap_parse_message(void *packet, uint8_t *data, uint16_t data_len)
 			coap_pkt->token[5], coap_pkt->token[6], coap_pkt->token[7]); /*FIXME always prints 8 bytes */
 
 	/* parse options */
-	memset(coap_pkt->options, 0, sizeof(coap_pkt->options));
 	current_option += coap_pkt->token_len;
 
+	uint8_t *option_header = NULL;
 	unsigned int option_number = 0;
 	unsigned int option_delta = 0;
 	size_t option_length = 0;
 
 	while (current_option < data + data_len) {
-		/* payload marker 0xFF, currently only checking for 0xF* because rest is reserved */
-		if ((current_option[0] & 0xF0) == 0xF0) {
+		/* payload marker 0xFF, other bytes with delta 15 are rejected by the option decoder */
+		if (current_option[0] == 0xFF) {
+			if (current_option + 1 == data + data_len && !chained) {
+				coap_error_message = "Payload marker without payload";
+				return BAD_REQUEST_4_00;
+			}
 			coap_pkt->payload = ++current_option;
 			coap_pkt->payload_len = data_len - (coap_pkt->payload - data);
 
+#if !COAP_STREAMING_PAYLOAD
 			/* also for receiving, the Erbium upper bound is REST_MAX_CHUNK_SIZE */
 			if (coap_pkt->payload_len > REST_MAX_CHUNK_SIZE) {
 				coap_pkt->payload_len = REST_MAX_CHUNK_SIZE;
-				/* null-terminate payload */
+				/* null-terminate payload, only inside the datagram */
+				coap_pkt->payload[coap_pkt->payload_len] = '\0';
 			}
-			coap_pkt->payload[coap_pkt->payload_len] = '\0';
+#endif
 
 			break;
 		}
 
-		option_delta = current_option[0] >> 4;
-		option_length = current_option[0] & 0x0F;
-		++current_option;
-
-		if (option_delta == 13) {
-			option_delta += current_option[0];
-			++current_option;
-		} else if (option_delta == 14) {
-			option_delta += 255;
-			option_delta += current_option[0] << 8;
-			++current_option;
-			option_delta += current_option[0];
-			++current_option;
-		}
-
-		if (option_length == 13) {
-			option_length += current_option[0];
-			++current_option;
-		} else if (option_length == 14) {
-			option_length += 255;
-			option_length += current_option[0] << 8;
-			++current_option;
-			option_length += current_option[0];
-			++current_option;
+		option_header = current_option;
+		current_option = coap_parse_option_header(current_option,
+				data + data_len, &option_delta, &option_length);
+		if (current_option == NULL) {
+			/* without the reserved nibble 15, the option ran past the buffer */
+			if (chained && (option_header[0] >> 4) != 15
+					&& (option_header[0] & 0x0F) != 15) {
+				coap_error_message = "Options must fit the first buffer";
+				return REQUEST_ENTITY_TOO_LARGE_4_13;
+			}
+			coap_error_message = "Malformed option";
+			return BAD_REQUEST_4_00;
 		}
 
 		option_number += option_delta;
@@ -531,47 +973,44 @@ coap_status_t coap_parse_message(void *packet, uint8_t *data, uint16_t data_len)
 		PRINTF("OPTION %u (delta %u, len %zu): ", option_number, option_delta,
 				option_length);
 
-		SET_OPTION(coap_pkt, option_number);
-
 		switch (option_number) {
 		case COAP_OPTION_CONTENT_FORMAT:
-			coap_pkt->content_format = coap_parse_int_option(current_option,
-					option_length);
-			PRINTF("Content-Format [%u]\n", coap_pkt->content_format);
-			break;
 		case COAP_OPTION_MAX_AGE:
-			coap_pkt->max_age = coap_parse_int_option(current_option,
-					option_length);
-			PRINTF("Max-Age [%lu]\n", (unsigned long )coap_pkt->max_age);
-			break;
 		case COAP_OPTION_ETAG:
-			coap_pkt->etag_len = MIN(COAP_ETAG_LEN, option_length);
-			memcpy(coap_pkt->etag, current_option, coap_pkt->etag_len);
-			PRINTF("ETag %u [0x%02X%02X%02X%02X%02X%02X%02X%02X]\n",
-					coap_pkt->etag_len, coap_pkt->etag[0], coap_pkt->etag[1],
-					coap_pkt->etag[2], coap_pkt->etag[3], coap_pkt->etag[4],
-					coap_pkt->etag[5], coap_pkt->etag[6], coap_pkt->etag[7]); /*FIXME always prints 8 bytes */
-			break;
 		case COAP_OPTION_ACCEPT:
-			coap_pkt->accept = coap_parse_int_option(current_option,
-					option_length);
-			PRINTF("Accept [%u]\n", coap_pkt->accept);
-			break;
 		case COAP_OPTION_IF_MATCH:
-			/* TODO support multiple ETags */
-			coap_pkt->if_match_len = MIN(COAP_ETAG_LEN, option_length);
-			memcpy(coap_pkt->if_match, current_option, coap_pkt->if_match_len);
-			PRINTF("If-Match %u [0x%02X%02X%02X%02X%02X%02X%02X%02X]\n",
-					coap_pkt->if_match_len, coap_pkt->if_match[0],
-					coap_pkt->if_match[1], coap_pkt->if_match[2],
-					coap_pkt->if_match[3], coap_pkt->if_match[4],
-					coap_pkt->if_match[5], coap_pkt->if_match[6],
-					coap_pkt->if_match[7]); /* FIXME always prints 8 bytes */
+		case COAP_OPTION_URI_PORT:
+		case COAP_OPTION_OBSERVE:
+		case COAP_OPTION_BLOCK2:
+		case COAP_OPTION_BLOCK1:
+		case COAP_OPTION_SIZE2:
+		case COAP_OPTION_SIZE1:
+			SET_OPTION(coap_pkt, option_number);
+			/* only remember where the value is, decoding is done by the getters */
+			if (coap_pkt->option_index_len < COAP_MAX_INDEXED_OPTIONS) {
+				coap_option_index_t *entry =
+						&coap_pkt->option_index[coap_pkt->option_index_len++];
+				entry->number = option_number;
+				entry->offset = current_option - data;
+				entry->length = option_length;
+				SET_PENDING(coap_pkt, option_number);
+				PRINTF("indexed\n");
+			} else {
+				coap_decode_option(coap_pkt, option_number, current_option,
+						option_length);
+			}
 			break;
 		case COAP_OPTION_IF_NONE_MATCH:
+			SET_OPTION(coap_pkt, option_number);
 			coap_pkt->if_none_match = 1;
 			PRINTF("If-None-Match\n");
 			break;
+		case COAP_OPTION_NO_RESPONSE:
+			/* needed by the engine for every request, so no lazy decoding */
+			coap_pkt->no_response = coap_parse_int_option(current_option,
+					option_length);
+			PRINTF("No-Response [%u]\n", coap_pkt->no_response);
+			break;
 
 		case COAP_OPTION_PROXY_URI:
 #if COAP_PROXY_OPTION_PROCESSING
@@ -595,90 +1034,22 @@ coap_status_t coap_parse_message(void *packet, uint8_t *data, uint16_t data_len)
 			break;
 
 		case COAP_OPTION_URI_HOST:
+			SET_OPTION(coap_pkt, option_number);
 			coap_pkt->uri_host = (char *) current_option;
 			coap_pkt->uri_host_len = option_length;
 			PRINTF("Uri-Host [%.*s]\n", (int )coap_pkt->uri_host_len,
 					coap_pkt->uri_host);
 			break;
-		case COAP_OPTION_URI_PORT:
-			coap_pkt->uri_port = coap_parse_int_option(current_option,
-					option_length);
-			PRINTF("Uri-Port [%u]\n", coap_pkt->uri_port);
-			break;
 		case COAP_OPTION_URI_PATH:
-			/* coap_merge_multi_option() operates in-place on the IPBUF, but final packet field should be const string -> cast to string */
-			coap_merge_multi_option((char **) &(coap_pkt->uri_path),
-					&(coap_pkt->uri_path_len), current_option, option_length,
-					'/');
-			PRINTF("Uri-Path [%.*s]\n", (int )coap_pkt->uri_path_len,
-					coap_pkt->uri_path);
-			break;
 		case COAP_OPTION_URI_QUERY:
-			/* coap_merge_multi_option() operates in-place on the IPBUF, but final packet field should be const string -> cast to string */
-			coap_merge_multi_option((char **) &(coap_pkt->uri_query),
-					&(coap_pkt->uri_query_len), current_option, option_length,
-					'&');
-			PRINTF("Uri-Query [%.*s]\n", (int )coap_pkt->uri_query_len,
-					coap_pkt->uri_query);
-			break;
-
 		case COAP_OPTION_LOCATION_PATH:
-			/* coap_merge_multi_option() operates in-place on the IPBUF, but final packet field should be const string -> cast to string */
-			coap_merge_multi_option((char **) &(coap_pkt->location_path),
-					&(coap_pkt->location_path_len), current_option,
-					option_length, '/');
-			PRINTF("Location-Path [%.*s]\n", (int )coap_pkt->location_path_len,
-					coap_pkt->location_path);
-			break;
 		case COAP_OPTION_LOCATION_QUERY:
-			/* coap_merge_multi_option() operates in-place on the IPBUF, but final packet field should be const string -> cast to string */
-			coap_merge_multi_option((char **) &(coap_pkt->location_query),
-					&(coap_pkt->location_query_len), current_option,
-					option_length, '&');
-			PRINTF("Location-Query [%.*s]\n",
-					(int )coap_pkt->location_query_len,
-					coap_pkt->location_query);
+			/* segments are left in place and merged only on request */
+			coap_add_segment(coap_pkt, option_number, option_header,
+					current_option, option_length);
+			PRINTF("segment [%.*s]\n", (int )option_length, current_option);
 			break;
 
-		case COAP_OPTION_OBSERVE:
-			coap_pkt->observe = coap_parse_int_option(current_option,
-					option_length);
-			PRINTF("Observe [%lu]\n", (unsigned long )coap_pkt->observe);
-			break;
-		case COAP_OPTION_BLOCK2:
-			coap_pkt->block2_num = coap_parse_int_option(current_option,
-					option_length);
-			coap_pkt->block2_more = (coap_pkt->block2_num & 0x08) >> 3;
-			coap_pkt->block2_size = 16 << (coap_pkt->block2_num & 0x07);
-			coap_pkt->block2_offset = (coap_pkt->block2_num & ~0x0000000F)
-					<< (coap_pkt->block2_num & 0x07);
-			coap_pkt->block2_num >>= 4;
-			PRINTF("Block2 [%lu%s (%u B/blk)]\n",
-					(unsigned long )coap_pkt->block2_num,
-					coap_pkt->block2_more ? "+" : "", coap_pkt->block2_size);
-			break;
-		case COAP_OPTION_BLOCK1:
-			coap_pkt->block1_num = coap_parse_int_option(current_option,
-					option_length);
-			coap_pkt->block1_more = (coap_pkt->block1_num & 0x08) >> 3;
-			coap_pkt->block1_size = 16 << (coap_pkt->block1_num & 0x07);
-			coap_pkt->block1_offset = (coap_pkt->block1_num & ~0x0000000F)
-					<< (coap_pkt->block1_num & 0x07);
-			coap_pkt->block1_num >>= 4;
-			PRINTF("Block1 [%lu%s (%u B/blk)]\n",
-					(unsigned long )coap_pkt->block1_num,
-					coap_pkt->block1_more ? "+" : "", coap_pkt->block1_size);
-			break;
-		case COAP_OPTION_SIZE2:
-			coap_pkt->size2 = coap_parse_int_option(current_option,
-					option_length);
-			PRINTF("Size2 [%lu]\n", (unsigned long )coap_pkt->size2);
-			break;
-		case COAP_OPTION_SIZE1:
-			coap_pkt->size1 = coap_parse_int_option(current_option,
-					option_length);
-			PRINTF("Size1 [%lu]\n", (unsigned long )coap_pkt->size1);
-			break;
 		default:
 			PRINTF("unknown (%u)\n", option_number);
 			/* check if critical (odd) */
@@ -694,15 +1065,109 @@ coap_status_t coap_parse_message(void *packet, uint8_t *data, uint16_t data_len)
 
 	return NO_ERROR;
 }
+coap_status_t coap_parse_message(void *packet, uint8_t *data, uint16_t data_len) {
+	return coap_parse_buffer(packet, data, data_len, 0);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Parses a datagram as delivered by lwIP. Header and options must be located
+ * in the first pbuf, the payload may continue over the rest of the chain and
+ * is then accessible through coap_read_payload() and coap_get_payload_chunk().
+ * coap_get_payload() keeps returning the contiguous part in the first pbuf.
+ */
+coap_status_t coap_parse_pbuf(void *packet, struct pbuf *p) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+	coap_status_t status;
+	uint8_t marker = 0;
+	size_t total = 0;
+
+	status = coap_parse_buffer(packet, p->payload, p->len, p->tot_len > p->len);
+	if (status != NO_ERROR) {
+		return status;
+	}
+
+	if (coap_pkt->payload) {
+		coap_pkt->payload_offset = coap_pkt->payload - (uint8_t *) p->payload;
+	} else if (p->tot_len > p->len) {
+		/* the payload marker may be the first byte of the next pbuf */
+		pbuf_copy_partial(p, &marker, 1, p->len);
+		if (marker != 0xFF) {
+			coap_error_message = "Options must fit the first buffer";
+			return REQUEST_ENTITY_TOO_LARGE_4_13;
+		}
+		coap_pkt->payload_offset = p->len + 1;
+	} else {
+		coap_pkt->payload_offset = p->len;
+	}
+	total = p->tot_len - coap_pkt->payload_offset;
+
+#if !COAP_STREAMING_PAYLOAD
+	/* keep the Erbium upper bound also for streamed reads */
+	total = MIN(REST_MAX_CHUNK_SIZE, total);
+#endif
+
+	coap_pkt->payload_pbuf = p;
+	coap_pkt->payload_total = total;
+	coap_pkt->payload_cursor = 0;
+
+	return NO_ERROR;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Locates an option in a serialized message, e.g., to patch its value in a
+ * prebuilt datagram. Returns a pointer to the value or NULL if not present.
+ */
+uint8_t *coap_find_option(uint8_t *data, uint16_t data_len,
+		unsigned int number, size_t *length) {
+	const uint8_t *end = data + data_len;
+	uint8_t *current_option;
+	unsigned int option_number = 0;
+	unsigned int option_delta;
+	size_t option_length;
+
+	if (data_len < COAP_HEADER_LEN) {
+		return NULL;
+	}
+	current_option = data + COAP_HEADER_LEN
+			+ ((COAP_HEADER_TOKEN_LEN_MASK & data[0])
+					>> COAP_HEADER_TOKEN_LEN_POSITION);
+
+	while (current_option < end && current_option[0] != 0xFF) {
+		current_option = coap_parse_option_header(current_option, end,
+				&option_delta, &option_length);
+		if (current_option == NULL) {
+			return NULL;
+		}
+		option_number += option_delta;
+		if (option_number == number) {
+			*length = option_length;
+			return current_option;
+		} else if (option_number > number) {
+			return NULL;
+		}
+		current_option += option_length;
+	}
+	return NULL;
+}
 /*---------------------------------------------------------------------------*/
 /*- REST Engine API ---------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 int coap_get_query_variable(void *packet, const char *name, const char **output) {
-	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+	coap_option_iter_t iter;
+	const uint8_t *segment;
+	int segment_len;
+	size_t name_len = strlen(name);
 
-	if (IS_OPTION(coap_pkt, COAP_OPTION_URI_QUERY)) {
-		return coap_get_variable(coap_pkt->uri_query, coap_pkt->uri_query_len,
-				name, output);
+	*output = 0;
+
+	/* every Uri-Query segment holds one key=value pair */
+	coap_option_iter_init(packet, COAP_OPTION_URI_QUERY, &iter);
+	while ((segment_len = coap_option_iter_next(&iter, &segment)) >= 0) {
+		if ((size_t) segment_len > name_len && segment[name_len] == '='
+				&& strncmp(name, (const char *) segment, name_len) == 0) {
+			*output = (const char *) segment + name_len + 1;
+			return segment_len - name_len - 1;
+		}
 	}
 	return 0;
 }
@@ -716,6 +1181,104 @@ int coap_get_post_variable(void *packet, const char *name, const char **output)
 	return 0;
 }
 /*---------------------------------------------------------------------------*/
+void coap_option_iter_init(void *packet, unsigned int number,
+		coap_option_iter_t *iter) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+	const char **view;
+	size_t *view_len;
+	coap_option_segments_t *segments = coap_get_segments(coap_pkt, number,
+			&view, &view_len, &iter->separator);
+
+	iter->next = NULL;
+	iter->end = NULL;
+	iter->remaining = 0;
+
+	if (segments == NULL || !IS_OPTION(coap_pkt, number)) {
+		return;
+	}
+	if (segments->start) {
+		/* walk the option headers in the received datagram */
+		iter->next = segments->start;
+		iter->end = coap_pkt->buffer + coap_pkt->buffer_len;
+		iter->remaining = segments->count;
+		iter->separator = '\0';
+	} else {
+		/* option was set as string: split at the separator */
+		iter->next = (const uint8_t *) *view;
+		iter->end = iter->next + *view_len;
+	}
+}
+/*---------------------------------------------------------------------------*/
+/* returns the segment length or -1 if there are no more segments (segments can be empty) */
+int coap_option_iter_next(coap_option_iter_t *iter, const uint8_t **segment) {
+	unsigned int delta;
+	size_t length;
+	const uint8_t *split;
+
+	if (iter->next == NULL) {
+		return -1;
+	}
+
+	if (iter->separator == '\0') {
+		if (iter->remaining == 0) {
+			iter->next = NULL;
+			return -1;
+		}
+		*segment = coap_parse_option_header((uint8_t *) iter->next, iter->end,
+				&delta, &length);
+		if (*segment == NULL) {
+			iter->next = NULL;
+			return -1;
+		}
+		iter->next = *segment + length;
+		--iter->remaining;
+		return length;
+	}
+
+	*segment = iter->next;
+	split = memchr(iter->next, iter->separator, iter->end - iter->next);
+	if (split) {
+		iter->next = split + 1;
+		return split - *segment;
+	}
+	iter->next = NULL;
+	return iter->end - *segment;
+}
+/*---------------------------------------------------------------------------*/
+int coap_match_uri_path(void *packet, const char *path, int sub_resources) {
+	coap_option_iter_t iter;
+	const uint8_t *segment;
+	int segment_len;
+	const char *part_end;
+	size_t part_len;
+
+	coap_option_iter_init(packet, COAP_OPTION_URI_PATH, &iter);
+
+	/* compare the resource path segment by segment */
+	while (path != NULL) {
+		part_end = strchr(path, '/');
+		part_len = part_end ? (size_t) (part_end - path) : strlen(path);
+
+		segment_len = coap_option_iter_next(&iter, &segment);
+		if (segment_len < 0) {
+			/* request without Uri-Path only matches the empty resource path */
+			return part_len == 0 && part_end == NULL
+					&& !IS_OPTION((coap_packet_t *)packet, COAP_OPTION_URI_PATH);
+		}
+		if ((size_t) segment_len != part_len
+				|| memcmp(segment, path, part_len) != 0) {
+			return 0;
+		}
+		path = part_end ? part_end + 1 : NULL;
+	}
+
+	/* remaining request segments address a sub-resource */
+	if (coap_option_iter_next(&iter, &segment) >= 0) {
+		return sub_resources;
+	}
+	return 1;
+}
+/*---------------------------------------------------------------------------*/
 int coap_set_status_code(void *packet, unsigned int code) {
 	if (code <= 0xFF) {
 		((coap_packet_t *) packet)->code = (uint8_t) code;
@@ -739,6 +1302,7 @@ int coap_set_token(void *packet, const uint8_t *token, size_t token_len) {
 int coap_get_header_content_format(void *packet, unsigned int *format) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
+	coap_resolve_option(coap_pkt, COAP_OPTION_CONTENT_FORMAT);
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_CONTENT_FORMAT)) {
 		return 0;
 	}
@@ -756,6 +1320,7 @@ int coap_set_header_content_format(void *packet, unsigned int format) {
 int coap_get_header_accept(void *packet, unsigned int *accept) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
+	coap_resolve_option(coap_pkt, COAP_OPTION_ACCEPT);
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_ACCEPT)) {
 		return 0;
 	}
@@ -773,6 +1338,7 @@ int coap_set_header_accept(void *packet, unsigned int accept) {
 int coap_get_header_max_age(void *packet, uint32_t *age) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
+	coap_resolve_option(coap_pkt, COAP_OPTION_MAX_AGE);
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_MAX_AGE)) {
 		*age = COAP_DEFAULT_MAX_AGE;
 	} else {
@@ -791,6 +1357,7 @@ int coap_set_header_max_age(void *packet, uint32_t age) {
 int coap_get_header_etag(void *packet, const uint8_t **etag) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
+	coap_resolve_option(coap_pkt, COAP_OPTION_ETAG);
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_ETAG)) {
 		return 0;
 	}
@@ -811,6 +1378,7 @@ int coap_set_header_etag(void *packet, const uint8_t *etag, size_t etag_len) {
 int coap_get_header_if_match(void *packet, const uint8_t **etag) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
+	coap_resolve_option(coap_pkt, COAP_OPTION_IF_MATCH);
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_IF_MATCH)) {
 		return 0;
 	}
@@ -882,6 +1450,7 @@ int coap_get_header_uri_path(void *packet, const char **path) {
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_URI_PATH)) {
 		return 0;
 	}
+	coap_merge_view(coap_pkt, COAP_OPTION_URI_PATH);
 	*path = coap_pkt->uri_path;
 	return coap_pkt->uri_path_len;
 }
@@ -892,6 +1461,7 @@ int coap_set_header_uri_path(void *packet, const char *path) {
 		++path;
 
 	coap_pkt->uri_path = path;
+	coap_pkt->uri_path_segments.start = NULL;
 	coap_pkt->uri_path_len = strlen(path);
 
 	SET_OPTION(coap_pkt, COAP_OPTION_URI_PATH);
@@ -904,6 +1474,7 @@ int coap_get_header_uri_query(void *packet, const char **query) {
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_URI_QUERY)) {
 		return 0;
 	}
+	coap_merge_view(coap_pkt, COAP_OPTION_URI_QUERY);
 	*query = coap_pkt->uri_query;
 	return coap_pkt->uri_query_len;
 }
@@ -914,6 +1485,7 @@ int coap_set_header_uri_query(void *packet, const char *query) {
 		++query;
 
 	coap_pkt->uri_query = query;
+	coap_pkt->uri_query_segments.start = NULL;
 	coap_pkt->uri_query_len = strlen(query);
 
 	SET_OPTION(coap_pkt, COAP_OPTION_URI_QUERY);
@@ -926,6 +1498,7 @@ int coap_get_header_location_path(void *packet, const char **path) {
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_LOCATION_PATH)) {
 		return 0;
 	}
+	coap_merge_view(coap_pkt, COAP_OPTION_LOCATION_PATH);
 	*path = coap_pkt->location_path;
 	return coap_pkt->location_path_len;
 }
@@ -944,6 +1517,7 @@ int coap_set_header_location_path(void *packet, const char *path) {
 		coap_pkt->location_path_len = strlen(path);
 	}
 	coap_pkt->location_path = path;
+	coap_pkt->location_path_segments.start = NULL;
 
 	if (coap_pkt->location_path_len > 0) {
 		SET_OPTION(coap_pkt, COAP_OPTION_LOCATION_PATH);
@@ -957,6 +1531,7 @@ int coap_get_header_location_query(void *packet, const char **query) {
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_LOCATION_QUERY)) {
 		return 0;
 	}
+	coap_merge_view(coap_pkt, COAP_OPTION_LOCATION_QUERY);
 	*query = coap_pkt->location_query;
 	return coap_pkt->location_query_len;
 }
@@ -967,6 +1542,7 @@ int coap_set_header_location_query(void *packet, const char *query) {
 		++query;
 
 	coap_pkt->location_query = query;
+	coap_pkt->location_query_segments.start = NULL;
 	coap_pkt->location_query_len = strlen(query);
 
 	SET_OPTION(coap_pkt, COAP_OPTION_LOCATION_QUERY);
@@ -976,6 +1552,7 @@ int coap_set_header_location_query(void *packet, const char *query) {
 int coap_get_header_observe(void *packet, uint32_t *observe) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
+	coap_resolve_option(coap_pkt, COAP_OPTION_OBSERVE);
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_OBSERVE)) {
 		return 0;
 	}
@@ -994,6 +1571,7 @@ int coap_get_header_block2(void *packet, uint32_t *num, uint8_t *more,
 		uint16_t *size, uint32_t *offset) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
+	coap_resolve_option(coap_pkt, COAP_OPTION_BLOCK2);
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_BLOCK2)) {
 		return 0;
 	}
@@ -1037,6 +1615,7 @@ int coap_get_header_block1(void *packet, uint32_t *num, uint8_t *more,
 		uint16_t *size, uint32_t *offset) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
+	coap_resolve_option(coap_pkt, COAP_OPTION_BLOCK1);
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_BLOCK1)) {
 		return 0;
 	}
@@ -1079,6 +1658,7 @@ int coap_set_header_block1(void *packet, uint32_t num, uint8_t more,
 int coap_get_header_size2(void *packet, uint32_t *size) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
+	coap_resolve_option(coap_pkt, COAP_OPTION_SIZE2);
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_SIZE2)) {
 		return 0;
 	}
@@ -1096,6 +1676,7 @@ int coap_set_header_size2(void *packet, uint32_t size) {
 int coap_get_header_size1(void *packet, uint32_t *size) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
+	coap_resolve_option(coap_pkt, COAP_OPTION_SIZE1);
 	if (!IS_OPTION(coap_pkt, COAP_OPTION_SIZE1)) {
 		return 0;
 	}
@@ -1110,6 +1691,30 @@ int coap_set_header_size1(void *packet, uint32_t size) {
 	return 1;
 }
 /*---------------------------------------------------------------------------*/
+int coap_get_header_no_response(void *packet, uint8_t *value) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+
+	if (!coap_pkt->no_response) {
+		return 0;
+	}
+	*value = coap_pkt->no_response;
+	return 1;
+}
+int coap_set_header_no_response(void *packet, uint8_t value) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+
+	coap_pkt->no_response = value;
+	return 1;
+}
+/* checks a response code against the No-Response option of the request */
+int coap_is_response_suppressed(void *request, uint8_t code) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) request;
+	uint8_t response_class = code >> 5;
+
+	return response_class > 0
+			&& (coap_pkt->no_response & (1 << (response_class - 1)));
+}
+/*---------------------------------------------------------------------------*/
 int coap_get_payload(void *packet, const uint8_t **payload) {
 	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
 
@@ -1126,7 +1731,85 @@ int coap_set_payload(void *packet, const void *payload, size_t length) {
 
 	coap_pkt->payload = (uint8_t *) payload;
 	coap_pkt->payload_len = MIN(REST_MAX_CHUNK_SIZE, length);
+	coap_pkt->payload_pbuf = NULL;
+	coap_pkt->payload_cursor = 0;
 
 	return coap_pkt->payload_len;
 }
 /*---------------------------------------------------------------------------*/
+int coap_get_payload_size(void *packet) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+
+	if (coap_pkt->payload_pbuf) {
+		return coap_pkt->payload_total;
+	}
+	return coap_pkt->payload ? coap_pkt->payload_len : 0;
+}
+/*
+ * Copies up to length payload bytes from the read cursor into buffer and
+ * advances the cursor. Returns the number of bytes copied, 0 at the end.
+ */
+int coap_read_payload(void *packet, void *buffer, size_t length) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+	size_t size = coap_get_payload_size(packet);
+
+	if (coap_pkt->payload_cursor >= size) {
+		return 0;
+	}
+	length = MIN(length, size - coap_pkt->payload_cursor);
+
+	if (coap_pkt->payload_pbuf) {
+		length = pbuf_copy_partial(coap_pkt->payload_pbuf, buffer, length,
+				coap_pkt->payload_offset + coap_pkt->payload_cursor);
+	} else {
+		memcpy(buffer, coap_pkt->payload + coap_pkt->payload_cursor, length);
+	}
+	coap_pkt->payload_cursor += length;
+
+	return length;
+}
+/*
+ * Returns the contiguous payload bytes at the read cursor without copying them
+ * and advances the cursor past them. Returns 0 at the end of the payload.
+ */
+int coap_get_payload_chunk(void *packet, const uint8_t **chunk) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+	size_t size = coap_get_payload_size(packet);
+	size_t offset;
+	size_t length;
+	struct pbuf *q;
+
+	*chunk = NULL;
+	if (coap_pkt->payload_cursor >= size) {
+		return 0;
+	}
+
+	if (coap_pkt->payload_pbuf) {
+		offset = coap_pkt->payload_offset + coap_pkt->payload_cursor;
+		for (q = coap_pkt->payload_pbuf; q && offset >= q->len; q = q->next) {
+			offset -= q->len;
+		}
+		if (q == NULL) {
+			return 0;
+		}
+		*chunk = (const uint8_t *) q->payload + offset;
+		length = q->len - offset;
+	} else {
+		*chunk = coap_pkt->payload + coap_pkt->payload_cursor;
+		length = size - coap_pkt->payload_cursor;
+	}
+	length = MIN(length, size - coap_pkt->payload_cursor);
+	coap_pkt->payload_cursor += length;
+
+	return length;
+}
+int coap_seek_payload(void *packet, size_t offset) {
+	coap_packet_t * const coap_pkt = (coap_packet_t *) packet;
+
+	if (offset > (size_t) coap_get_payload_size(packet)) {
+		return 0;
+	}
+	coap_pkt->payload_cursor = offset;
+	return 1;
+}
+/*---------------------------------------------------------------------------*/
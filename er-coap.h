@@ -43,6 +43,7 @@
 #include "porting.h"
 #include "er-coap-constants.h"
 #include "er-coap-conf.h"
+#include "er-coap-id.h"
 
 /* sanity check for configured values */
 
@@ -72,14 +73,41 @@ enum {
 	OPTION_MAP_SIZE = sizeof(uint8_t) * 8
 };
 
-#define SET_OPTION(packet, opt) ((packet)->options[opt / OPTION_MAP_SIZE] |= 1 << (opt % OPTION_MAP_SIZE))
+#define SET_OPTION(packet, opt) ((packet)->options[opt / OPTION_MAP_SIZE] |= 1 << (opt % OPTION_MAP_SIZE), \
+                                 (packet)->pending[opt / OPTION_MAP_SIZE] &= ~(1 << (opt % OPTION_MAP_SIZE)))
 #define IS_OPTION(packet, opt) ((packet)->options[opt / OPTION_MAP_SIZE] & (1 << (opt % OPTION_MAP_SIZE)))
 
+/* bitmap for parsed options whose value has not been decoded yet */
+#define SET_PENDING(packet, opt) ((packet)->pending[opt / OPTION_MAP_SIZE] |= 1 << (opt % OPTION_MAP_SIZE))
+#define IS_PENDING(packet, opt) ((packet)->pending[opt / OPTION_MAP_SIZE] & (1 << (opt % OPTION_MAP_SIZE)))
+
+/* index entry for an option that is decoded on first access */
+typedef struct {
+	uint16_t number;
+	uint16_t offset; /* offset of the option value from the start of the buffer */
+	uint16_t length;
+} coap_option_index_t;
+
+/* repeatable option (e.g., Uri-Path) as found in a received datagram */
+typedef struct {
+	const uint8_t *start; /* header of the first segment, NULL if the option was set or merged as string */
+	uint8_t count; /* number of consecutive segments */
+} coap_option_segments_t;
+
+/* non-destructive iterator over the segments of a repeatable option */
+typedef struct {
+	const uint8_t *next; /* next option header in the datagram or next position in the string */
+	const uint8_t *end; /* end of the string or of the datagram */
+	uint8_t remaining; /* segments left in the datagram */
+	char separator; /* '\0' when iterating over the datagram */
+} coap_option_iter_t;
+
 /* parsed message struct */
 typedef struct {
 	ip_addr_t addr;
 	uint16_t port;
 	uint8_t *buffer; /* pointer to CoAP header / incoming packet buffer / memory to serialize packet */
+	uint16_t buffer_len; /* length of the incoming packet the option headers are validated against */
 
 	uint8_t version;
 	coap_message_type_t type;
@@ -90,6 +118,7 @@ typedef struct {
 	uint8_t token[COAP_TOKEN_LEN];
 
 	uint8_t options[COAP_OPTION_SIZE1 / OPTION_MAP_SIZE + 1]; /* bitmap to check if option is set */
+	uint8_t pending[COAP_OPTION_SIZE1 / OPTION_MAP_SIZE + 1]; /* bitmap to check if option still needs decoding */
 
 	uint16_t content_format; /* parse options once and store; allows setting options in random order  */
 	uint32_t max_age;
@@ -125,11 +154,34 @@ typedef struct {
 	size_t uri_query_len;
 	const char *uri_query;
 	uint8_t if_none_match;
+	uint8_t no_response; /* beyond the option bitmap, 0 is the same as absent */
+
+	coap_option_segments_t uri_path_segments;
+	coap_option_segments_t uri_query_segments;
+	coap_option_segments_t location_path_segments;
+	coap_option_segments_t location_query_segments;
 
 	uint16_t payload_len;
 	uint8_t *payload;
+
+	/* received datagram the payload can be streamed from, only valid while the request is handled */
+	struct pbuf *payload_pbuf;
+	uint16_t payload_offset; /* offset of the first payload byte within payload_pbuf */
+	uint16_t payload_total;  /* payload length across the whole pbuf chain */
+	uint16_t payload_cursor; /* read position of coap_read_payload() */
+
+	/* must stay last: coap_init_message() does not clear the index */
+	uint8_t option_index_len;
+	coap_option_index_t option_index[COAP_MAX_INDEXED_OPTIONS];
 } coap_packet_t;
 
+/* reference-counted buffer whose bytes are sent as the tail of several datagrams */
+typedef struct {
+	uint16_t refs;
+	uint16_t len;
+	uint8_t data[COAP_MAX_PACKET_SIZE + 1];
+} coap_shared_buffer_t;
+
 /* option format serialization */
 #define COAP_SERIALIZE_INT_OPTION(number, field, text) \
   if(IS_OPTION(coap_pkt, number)) { \
@@ -170,25 +222,58 @@ typedef struct {
     current_number = number; \
   }
 
-/* to store error code and human-readable payload */
+/* to store error code and human-readable payload, per engine worker */
+typedef struct coap_context {
+	coap_status_t status_code;
+	char *error_message;
+} coap_context_t;
+
+#if COAP_ENGINE_WORKERS > 1
+coap_context_t *coap_get_context(void);
+void coap_set_context(coap_context_t *context);
+#define erbium_status_code (coap_get_context()->status_code)
+#define coap_error_message (coap_get_context()->error_message)
+#else
 extern coap_status_t erbium_status_code;
 extern char *coap_error_message;
+#endif
+
+/* receive queue of each engine worker */
+extern QueueHandle_t coap_receive_queues[COAP_ENGINE_WORKERS];
+
+unsigned int coap_endpoint_shard(ip_addr_t *addr, uint16_t port);
+void coap_kick_worker(unsigned int shard);
 
 void coap_init_connection(uint16_t port);
-uint16_t coap_get_mid(void);
 
 void coap_init_message(void *packet, coap_message_type_t type, uint8_t code,
 		uint16_t mid);
 size_t coap_serialize_message(void *packet, uint8_t *buffer, ip_addr_t *addr, uint16_t port);
+size_t coap_serialize_message_at(void *packet, uint8_t *buffer,
+		uint16_t buffer_len, ip_addr_t *addr, uint16_t port, uint16_t *offset);
 void coap_send_message(ip_addr_t *addr, uint16_t port, uint8_t *data,
 		uint16_t length);
+void coap_send_pbuf(ip_addr_t *addr, uint16_t port, struct pbuf *p);
+coap_shared_buffer_t *coap_alloc_shared_buffer(void);
+void coap_ref_shared_buffer(coap_shared_buffer_t *buffer);
+void coap_release_shared_buffer(coap_shared_buffer_t *buffer);
+struct pbuf *coap_shared_buffer_pbuf(coap_shared_buffer_t *buffer,
+		uint16_t offset, uint16_t len);
 coap_status_t coap_parse_message(void *request, uint8_t *data,
 		uint16_t data_len);
+coap_status_t coap_parse_pbuf(void *request, struct pbuf *p);
+uint8_t *coap_find_option(uint8_t *data, uint16_t data_len,
+		unsigned int number, size_t *length);
 
 int coap_get_query_variable(void *packet, const char *name,
 		const char **output);
 int coap_get_post_variable(void *packet, const char *name, const char **output);
 
+void coap_option_iter_init(void *packet, unsigned int number,
+		coap_option_iter_t *iter);
+int coap_option_iter_next(coap_option_iter_t *iter, const uint8_t **segment);
+int coap_match_uri_path(void *packet, const char *path, int sub_resources);
+
 /*---------------------------------------------------------------------------*/
 
 int coap_set_status_code(void *packet, unsigned int code);
@@ -223,6 +308,7 @@ int coap_set_header_proxy_scheme(void *packet, const char *scheme);
 int coap_get_header_uri_host(void *packet, const char **host); /* in-place string might not be 0-terminated. */
 int coap_set_header_uri_host(void *packet, const char *host);
 
+/* Multi-segment options are merged on demand in place, over the option headers in the received datagram. */
 int coap_get_header_uri_path(void *packet, const char **path); /* in-place string might not be 0-terminated. */
 int coap_set_header_uri_path(void *packet, const char *path);
 
@@ -254,7 +340,16 @@ int coap_set_header_size2(void *packet, uint32_t size);
 int coap_get_header_size1(void *packet, uint32_t *size);
 int coap_set_header_size1(void *packet, uint32_t size);
 
+int coap_get_header_no_response(void *packet, uint8_t *value);
+int coap_set_header_no_response(void *packet, uint8_t value);
+int coap_is_response_suppressed(void *request, uint8_t code);
+
 int coap_get_payload(void *packet, const uint8_t **payload);
 int coap_set_payload(void *packet, const void *payload, size_t length);
 
+int coap_get_payload_size(void *packet);
+int coap_read_payload(void *packet, void *buffer, size_t length);
+int coap_get_payload_chunk(void *packet, const uint8_t **chunk);
+int coap_seek_payload(void *packet, size_t offset);
+
 #endif /* ER_COAP_H_ */
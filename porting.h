@@ -41,6 +41,7 @@
 #define PORTING_H_
 
 #include <FreeRTOS.h>
+#include <task.h>
 #include <timers.h>
 #include <queue.h>
 #include <ip_addr.h>
@@ -140,22 +140,14 @@ int rest_invoke_restful_service(void *request, void *response, uint8_t *buffer,
 	uint8_t allowed = 1;
 
 	resource_t *resource = NULL;
-	const char *url = NULL;
-	int url_len, res_url_len;
 
-	url_len = REST.get_url(request, &url);
-	PRINTF("requested url: %s\n", url);
 	PRINTF("len:%d\n", list_length(restful_services));
 	for (resource = (resource_t *) list_head(restful_services); resource;
 			resource = resource->next) {
 		PRINTF("resource url: %s\n", resource->url);
 		/* if the web service handles that kind of requests and urls matches */
-		res_url_len = strlen(resource->url);
-		if ((url_len == res_url_len
-				|| (url_len > res_url_len
-						&& (resource->flags & HAS_SUB_RESOURCES)
-						&& url[res_url_len] == '/'))
-				&& strncmp(resource->url, url, res_url_len) == 0) {
+		if (REST.match_url(request, resource->url,
+				resource->flags & HAS_SUB_RESOURCES)) {
 			found = 1;
 			rest_resource_flags_t method = REST.get_method_type(request);
 
@@ -96,6 +96,7 @@ struct resource_s {
     restful_trigger_handler trigger;
     restful_trigger_handler resume;
   };
+  void *observers;                /* subscribers, kept by the CoAP observe layer */
 };
 typedef struct resource_s resource_t;
 
@@ -113,16 +114,16 @@ typedef struct periodic_resource_s periodic_resource_t;
  * Resources are statically defined for the sake of efficiency and better memory management.
  */
 #define RESOURCE(name, attributes, get_handler, post_handler, put_handler, delete_handler) \
-  resource_t name = { NULL, NULL, NO_FLAGS, attributes, get_handler, post_handler, put_handler, delete_handler, { NULL } }
+  resource_t name = { NULL, NULL, NO_FLAGS, attributes, get_handler, post_handler, put_handler, delete_handler, { NULL }, NULL }
 
 #define PARENT_RESOURCE(name, attributes, get_handler, post_handler, put_handler, delete_handler) \
-  resource_t name = { NULL, NULL, HAS_SUB_RESOURCES, attributes, get_handler, post_handler, put_handler, delete_handler, { NULL } }
+  resource_t name = { NULL, NULL, HAS_SUB_RESOURCES, attributes, get_handler, post_handler, put_handler, delete_handler, { NULL }, NULL }
 
 #define SEPARATE_RESOURCE(name, attributes, get_handler, post_handler, put_handler, delete_handler, resume_handler) \
-  resource_t name = { NULL, NULL, IS_SEPARATE, attributes, get_handler, post_handler, put_handler, delete_handler, { .resume = resume_handler } }
+  resource_t name = { NULL, NULL, IS_SEPARATE, attributes, get_handler, post_handler, put_handler, delete_handler, { .resume = resume_handler }, NULL }
 
 #define EVENT_RESOURCE(name, attributes, get_handler, post_handler, put_handler, delete_handler, event_handler) \
-  resource_t name = { NULL, NULL, IS_OBSERVABLE, attributes, get_handler, post_handler, put_handler, delete_handler, { .trigger = event_handler } }
+  resource_t name = { NULL, NULL, IS_OBSERVABLE, attributes, get_handler, post_handler, put_handler, delete_handler, { .trigger = event_handler }, NULL }
 
 /*
  * Macro to define a periodic resource.
@@ -132,7 +133,7 @@ typedef struct periodic_resource_s periodic_resource_t;
  */
 #define PERIODIC_RESOURCE(name, attributes, get_handler, post_handler, put_handler, delete_handler, period, periodic_handler) \
   periodic_resource_t periodic_##name; \
-  resource_t name = { NULL, NULL, IS_OBSERVABLE | IS_PERIODIC, attributes, get_handler, post_handler, put_handler, delete_handler, { .periodic = &periodic_##name } }; \
+  resource_t name = { NULL, NULL, IS_OBSERVABLE | IS_PERIODIC, attributes, get_handler, post_handler, put_handler, delete_handler, { .periodic = &periodic_##name }, NULL }; \
   periodic_resource_t periodic_##name = { NULL, &name, period, { { 0 } }, periodic_handler };
 
 struct rest_implementation {
@@ -147,6 +148,9 @@ struct rest_implementation {
   /** Get request URI path. */
   int (*get_url)(void *request, const char **url);
 
+  /** Check if the request URI path addresses the given path (or one of its sub-resources). */
+  int (*match_url)(void *request, const char *url, int sub_resources);
+
   /** Get the method of a request. */
   rest_resource_flags_t (*get_method_type)(void *request);
 
@@ -195,6 +199,9 @@ struct rest_implementation {
   /** Get the payload option of a request. */
   int (*get_request_payload)(void *request, const uint8_t **payload);
 
+  /** Copy the next part of the request payload, also beyond the first buffer. */
+  int (*read_request_payload)(void *request, void *buffer, size_t length);
+
   /** Set the payload option of a response. */
   int (*set_response_payload)(void *response, const void *payload,
                               size_t length);
@@ -0,0 +1,105 @@
+/*
+ * libFuzzer target for the message parser. Each input is parsed once as a
+ * flat datagram and once as a pbuf chain split at a point taken from the
+ * input, then every option and the payload are read back through the getters.
+ *
+ * Build and run from the repository root:
+ *
+ *   clang -std=gnu99 -fcommon -g -O1 -fsanitize=fuzzer,address,undefined \
+ *     -pthread -Itests/host -I. -DREST=coap_rest_implementation \
+ *     tests/fuzz-parse.c tests/host/host.c *.c -o fuzz-parse
+ *   ./fuzz-parse -max_len=1280
+ *
+ * Without libFuzzer, add -DFUZZ_STANDALONE to run the target once per file
+ * given on the command line, e.g., to replay a crash.
+ */
+#include <stdio.h>
+#include <string.h>
+#include "er-coap.h"
+
+/*---------------------------------------------------------------------------*/
+static void read_back(coap_packet_t *packet) {
+	const uint8_t *bytes;
+	const char *text;
+	uint8_t buffer[64];
+	uint32_t u32;
+	unsigned int format;
+	uint8_t more;
+	uint16_t size;
+
+	coap_get_header_content_format(packet, &format);
+	coap_get_header_accept(packet, &format);
+	coap_get_header_max_age(packet, &u32);
+	coap_get_header_etag(packet, &bytes);
+	coap_get_header_if_match(packet, &bytes);
+	coap_get_header_if_none_match(packet);
+	coap_get_header_proxy_uri(packet, &text);
+	coap_get_header_uri_host(packet, &text);
+	coap_get_header_uri_path(packet, &text);
+	coap_get_header_uri_query(packet, &text);
+	coap_get_header_location_path(packet, &text);
+	coap_get_header_location_query(packet, &text);
+	coap_get_header_observe(packet, &u32);
+	coap_get_header_block2(packet, &u32, &more, &size, &u32);
+	coap_get_header_block1(packet, &u32, &more, &size, &u32);
+	coap_get_header_size2(packet, &u32);
+	coap_get_header_size1(packet, &u32);
+	coap_get_header_no_response(packet, &more);
+	coap_get_query_variable(packet, "a", &text);
+	coap_match_uri_path(packet, "a/b", 1);
+	coap_get_payload(packet, &bytes);
+	while (coap_read_payload(packet, buffer, sizeof(buffer)) > 0)
+		;
+}
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static uint8_t datagram[COAP_MAX_PACKET_SIZE + 1];
+	coap_packet_t packet[1];
+	struct pbuf *head;
+	struct pbuf *tail;
+	uint16_t split;
+
+	if (size == 0 || size > sizeof(datagram)) {
+		return 0;
+	}
+
+	/* the parser merges repeated options in place, so it gets a copy */
+	memcpy(datagram, data, size);
+	if (coap_parse_message(packet, datagram, size) == NO_ERROR) {
+		read_back(packet);
+	}
+
+	/* first byte picks where the datagram is split across two pbufs */
+	split = 1 + data[0] % size;
+	head = pbuf_alloc(PBUF_RAW, split, PBUF_RAM);
+	memcpy(head->payload, data, split);
+	if (split < size) {
+		tail = pbuf_alloc(PBUF_RAW, size - split, PBUF_RAM);
+		memcpy(tail->payload, data + split, size - split);
+		pbuf_cat(head, tail);
+	}
+	if (coap_parse_pbuf(packet, head) == NO_ERROR) {
+		read_back(packet);
+	}
+	pbuf_free(head);
+	return 0;
+}
+/*---------------------------------------------------------------------------*/
+#ifdef FUZZ_STANDALONE
+int main(int argc, char *argv[]) {
+	static uint8_t input[4096];
+	size_t len;
+	FILE *f;
+	int i;
+
+	for (i = 1; i < argc; ++i) {
+		if ((f = fopen(argv[i], "rb")) == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		len = fread(input, 1, sizeof(input), f);
+		fclose(f);
+		LLVMFuzzerTestOneInput(input, len);
+	}
+	return 0;
+}
+#endif
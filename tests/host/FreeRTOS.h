@@ -0,0 +1,40 @@
+/*
+ * Host stand-in for the FreeRTOS headers, just enough to build the stack
+ * into the tests. Critical sections map to one recursive mutex, so tasks
+ * are simulated by threads.
+ */
+#ifndef HOST_FREERTOS_H_
+#define HOST_FREERTOS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t StackType_t;
+typedef void *QueueHandle_t;
+typedef void *TimerHandle_t;
+typedef void *TaskHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define pdMS_TO_TICKS(ms)    ((TickType_t) (ms))
+#define pdTRUE               1
+#define pdFALSE              0
+#define pdPASS               1
+#define portMAX_DELAY        0xffffffffUL
+#define portTICK_PERIOD_MS   1
+
+void host_enter_critical(void);
+void host_exit_critical(void);
+#define portENTER_CRITICAL() host_enter_critical()
+#define portEXIT_CRITICAL()  host_exit_critical()
+#define taskENTER_CRITICAL() host_enter_critical()
+#define taskEXIT_CRITICAL()  host_exit_critical()
+
+/* tick count returned by xTaskGetTickCount(), advanced by the tests */
+extern TickType_t host_ticks;
+
+#endif /* HOST_FREERTOS_H_ */
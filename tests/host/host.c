@@ -0,0 +1,211 @@
+/*
+ * Host stand-ins for the FreeRTOS and lwIP calls the stack makes. Queues and
+ * timers do nothing; pbufs live on the heap and sent datagrams are counted.
+ */
+#include <string.h>
+#include <pthread.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "timers.h"
+#include "lwip/udp.h"
+
+TickType_t host_ticks;
+unsigned long host_sent;
+uint8_t host_last_sent[2048];
+u16_t host_last_len;
+
+static pthread_once_t critical_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t critical;
+static int dummy_handle;
+static void *tls;
+
+/*---------------------------------------------------------------------------*/
+/* critical sections nest, as in FreeRTOS */
+static void critical_init(void) {
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&critical, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+void host_enter_critical(void) {
+	pthread_once(&critical_once, critical_init);
+	pthread_mutex_lock(&critical);
+}
+void host_exit_critical(void) {
+	pthread_mutex_unlock(&critical);
+}
+/*---------------------------------------------------------------------------*/
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint16_t depth,
+		void *parameters, UBaseType_t priority, TaskHandle_t *task) {
+	return pdPASS;
+}
+TickType_t xTaskGetTickCount(void) {
+	return host_ticks;
+}
+void vTaskDelay(TickType_t ticks) {
+}
+void *pvTaskGetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index) {
+	return tls;
+}
+void vTaskSetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index,
+		void *value) {
+	tls = value;
+}
+/*---------------------------------------------------------------------------*/
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+	return &dummy_handle;
+}
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait) {
+	return pdPASS;
+}
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait) {
+	return pdFALSE;
+}
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t wait) {
+	return pdFALSE;
+}
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+	return 0;
+}
+/*---------------------------------------------------------------------------*/
+TimerHandle_t xTimerCreate(const char *name, TickType_t period,
+		UBaseType_t reload, void *id, TimerCallbackFunction_t callback) {
+	return &dummy_handle;
+}
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t wait) {
+	return pdPASS;
+}
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait) {
+	return pdPASS;
+}
+BaseType_t xTimerDelete(TimerHandle_t timer, TickType_t wait) {
+	return pdPASS;
+}
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t wait) {
+	return pdPASS;
+}
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period,
+		TickType_t wait) {
+	return pdPASS;
+}
+TickType_t xTimerGetPeriod(TimerHandle_t timer) {
+	return 1;
+}
+void *pvTimerGetTimerID(TimerHandle_t timer) {
+	return NULL;
+}
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer) {
+	return pdFALSE;
+}
+/*---------------------------------------------------------------------------*/
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type) {
+	struct pbuf *p = calloc(1, sizeof(*p) + (type == PBUF_RAM ? length : 0));
+
+	if (p) {
+		p->len = p->tot_len = length;
+		p->type = type;
+		p->ref = 1;
+		if (type == PBUF_RAM) {
+			p->payload = p + 1;
+		}
+	}
+	return p;
+}
+struct pbuf *pbuf_alloced_custom(pbuf_layer layer, u16_t length,
+		pbuf_type type, struct pbuf_custom *c, void *payload_mem,
+		u16_t payload_mem_len) {
+	struct pbuf *p = &c->pbuf;
+
+	if (length > payload_mem_len) {
+		return NULL;
+	}
+	p->next = NULL;
+	p->payload = payload_mem;
+	p->len = p->tot_len = length;
+	p->type = type;
+	p->flags = PBUF_FLAG_IS_CUSTOM;
+	p->ref = 1;
+	return p;
+}
+u8_t pbuf_free(struct pbuf *p) {
+	struct pbuf *next;
+	u8_t count = 0;
+
+	for (; p && --p->ref == 0; p = next, ++count) {
+		next = p->next;
+		if (p->flags & PBUF_FLAG_IS_CUSTOM) {
+			((struct pbuf_custom *) p)->custom_free_function(p);
+		} else {
+			free(p);
+		}
+	}
+	return count;
+}
+void pbuf_ref(struct pbuf *p) {
+	++p->ref;
+}
+void pbuf_cat(struct pbuf *head, struct pbuf *tail) {
+	struct pbuf *p;
+
+	for (p = head; p->next; p = p->next) {
+		p->tot_len += tail->tot_len;
+	}
+	p->tot_len += tail->tot_len;
+	p->next = tail;
+}
+void pbuf_chain(struct pbuf *head, struct pbuf *tail) {
+	pbuf_cat(head, tail);
+	pbuf_ref(tail);
+}
+err_t pbuf_take(struct pbuf *p, const void *data, u16_t len) {
+	memcpy(p->payload, data, len);
+	return ERR_OK;
+}
+u16_t pbuf_copy_partial(const struct pbuf *p, void *data, u16_t len,
+		u16_t offset) {
+	u16_t copied = 0;
+	u16_t n;
+
+	for (; p && len; p = p->next) {
+		if (offset >= p->len) {
+			offset -= p->len;
+			continue;
+		}
+		n = p->len - offset < len ? p->len - offset : len;
+		memcpy((uint8_t *) data + copied, (uint8_t *) p->payload + offset, n);
+		copied += n;
+		len -= n;
+		offset = 0;
+	}
+	return copied;
+}
+u8_t pbuf_header(struct pbuf *p, int16_t increment) {
+	return 0;
+}
+u8_t pbuf_get_at(const struct pbuf *p, u16_t offset) {
+	u8_t byte = 0;
+
+	pbuf_copy_partial(p, &byte, 1, offset);
+	return byte;
+}
+/*---------------------------------------------------------------------------*/
+struct udp_pcb *udp_new(void) {
+	return (struct udp_pcb *) &dummy_handle;
+}
+err_t udp_bind(struct udp_pcb *pcb, ip_addr_t *addr, u16_t port) {
+	return ERR_OK;
+}
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *arg) {
+}
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr,
+		u16_t port) {
+	host_enter_critical();
+	++host_sent;
+	host_last_len = pbuf_copy_partial(p, host_last_sent,
+			sizeof(host_last_sent), 0);
+	host_exit_critical();
+	return ERR_OK;
+}
@@ -0,0 +1,27 @@
+/* IPv4-only stand-in for lwIP's address types */
+#ifndef HOST_IP_ADDR_H_
+#define HOST_IP_ADDR_H_
+
+#include <stdint.h>
+
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+typedef int8_t err_t;
+
+#define ERR_OK 0
+
+struct ip_addr {
+	uint32_t addr;
+};
+typedef struct ip_addr ip_addr_t;
+
+#define IP_ADDR_ANY            ((ip_addr_t *) 0)
+#define ip_addr_copy(dest, src) ((dest).addr = (src).addr)
+#define ip_addr_cmp(a, b)      ((a)->addr == (b)->addr)
+#define ip4_addr1_16(a)        ((u16_t) (((a)->addr >> 24) & 0xff))
+#define ip4_addr2_16(a)        ((u16_t) (((a)->addr >> 16) & 0xff))
+#define ip4_addr3_16(a)        ((u16_t) (((a)->addr >> 8) & 0xff))
+#define ip4_addr4_16(a)        ((u16_t) ((a)->addr & 0xff))
+
+#endif /* HOST_IP_ADDR_H_ */
@@ -0,0 +1,2 @@
+/* FreeRTOS' list.h is shadowed by the stack's own lists on the host */
+#include "contiki-list.h"
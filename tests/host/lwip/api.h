@@ -0,0 +1 @@
+#include "../ip_addr.h"
@@ -0,0 +1,46 @@
+#ifndef HOST_LWIP_PBUF_H_
+#define HOST_LWIP_PBUF_H_
+
+#include "../ip_addr.h"
+
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+#define PBUF_FLAG_IS_CUSTOM      0x02U
+
+typedef enum {
+	PBUF_TRANSPORT, PBUF_IP, PBUF_LINK, PBUF_RAW
+} pbuf_layer;
+typedef enum {
+	PBUF_RAM, PBUF_ROM, PBUF_REF, PBUF_POOL
+} pbuf_type;
+
+struct pbuf {
+	struct pbuf *next;
+	void *payload;
+	u16_t tot_len;
+	u16_t len;
+	u8_t type;
+	u8_t flags;
+	u16_t ref;
+};
+
+typedef void (*pbuf_free_custom_fn)(struct pbuf *p);
+struct pbuf_custom {
+	struct pbuf pbuf;
+	pbuf_free_custom_fn custom_free_function;
+};
+
+struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+struct pbuf *pbuf_alloced_custom(pbuf_layer layer, u16_t length,
+		pbuf_type type, struct pbuf_custom *p, void *payload_mem,
+		u16_t payload_mem_len);
+u8_t pbuf_free(struct pbuf *p);
+void pbuf_ref(struct pbuf *p);
+void pbuf_cat(struct pbuf *head, struct pbuf *tail);
+void pbuf_chain(struct pbuf *head, struct pbuf *tail);
+err_t pbuf_take(struct pbuf *p, const void *data, u16_t len);
+u16_t pbuf_copy_partial(const struct pbuf *p, void *data, u16_t len,
+		u16_t offset);
+u8_t pbuf_header(struct pbuf *p, int16_t increment);
+u8_t pbuf_get_at(const struct pbuf *p, u16_t offset);
+
+#endif /* HOST_LWIP_PBUF_H_ */
@@ -0,0 +1,21 @@
+#ifndef HOST_LWIP_UDP_H_
+#define HOST_LWIP_UDP_H_
+
+#include "pbuf.h"
+
+struct udp_pcb;
+typedef void (*udp_recv_fn)(void *arg, struct udp_pcb *pcb, struct pbuf *p,
+		struct ip_addr *addr, u16_t port);
+
+struct udp_pcb *udp_new(void);
+err_t udp_bind(struct udp_pcb *pcb, ip_addr_t *addr, u16_t port);
+void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *arg);
+err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, ip_addr_t *addr,
+		u16_t port);
+
+/* datagrams handed to udp_sendto(), and a copy of the last one */
+extern unsigned long host_sent;
+extern uint8_t host_last_sent[];
+extern u16_t host_last_len;
+
+#endif /* HOST_LWIP_UDP_H_ */
@@ -0,0 +1,14 @@
+#ifndef HOST_TASK_H_
+#define HOST_TASK_H_
+
+#include "FreeRTOS.h"
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint16_t depth,
+		void *parameters, UBaseType_t priority, TaskHandle_t *task);
+TickType_t xTaskGetTickCount(void);
+void vTaskDelay(TickType_t ticks);
+void *pvTaskGetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index);
+void vTaskSetThreadLocalStoragePointer(TaskHandle_t task, BaseType_t index,
+		void *value);
+
+#endif /* HOST_TASK_H_ */
@@ -0,0 +1,164 @@
+/*
+ * Host-side stress test for the observer list. Application threads notify
+ * the resource while the main thread registers, removes, acknowledges, and
+ * runs the timers of its observers. Every observer the stack frees is checked
+ * to be unlinked and disarmed, then poisoned, so a reader that still stood on
+ * it follows garbage pointers.
+ *
+ * Build and run from the repository root:
+ *
+ *   cc -std=gnu99 -fcommon -g -O1 -fsanitize=address,undefined -pthread \
+ *     -Itests/host -I. -DREST=coap_rest_implementation \
+ *     -Wl,--wrap=memb_free tests/observe-stress.c tests/host/host.c *.c \
+ *     -o observe-stress && ./observe-stress
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "er-coap.h"
+#include "er-coap-observe.h"
+#include "er-coap-timer.h"
+#include "memb.h"
+
+#define NOTIFIERS  3
+#define ITERATIONS 1000000
+#define CLIENTS    6
+
+static void res_get_handler(void *request, void *response, uint8_t *buffer,
+		uint16_t preferred_size, int32_t *offset);
+RESOURCE(res_stress, "title=\"Stress\";obs", res_get_handler, NULL, NULL,
+		NULL);
+
+static volatile int stop;
+static unsigned long notifies;
+
+void __real_memb_free(struct memb *m, void *ptr);
+
+/*---------------------------------------------------------------------------*/
+static void fail(const char *reason) {
+	fprintf(stderr, "FAIL: %s\n", reason);
+	abort();
+}
+/* the stack frees observers only once no reader can reach them */
+void __wrap_memb_free(struct memb *m, void *ptr) {
+	if (m->size == sizeof(coap_observer_t)) {
+		coap_observer_t *o = (coap_observer_t *) ptr;
+		coap_observer_t *obs;
+
+		for (obs = (coap_observer_t *) res_stress.observers; obs;
+				obs = obs->next) {
+			if (obs == o) {
+				fail("freed observer is still linked");
+			}
+		}
+		if (coap_timer_armed(&o->con.timer)) {
+			fail("freed observer has its retransmission timer armed");
+		}
+#if COAP_OBSERVE_CONDITIONS
+		if (coap_timer_armed(&o->timer)) {
+			fail("freed observer has its pmin/pmax timer armed");
+		}
+#endif
+		memset(ptr, 0xA5, m->size);
+	}
+	__real_memb_free(m, ptr);
+}
+/*---------------------------------------------------------------------------*/
+static void res_get_handler(void *request, void *response, uint8_t *buffer,
+		uint16_t preferred_size, int32_t *offset) {
+	REST.set_response_payload(response, buffer,
+			snprintf((char *) buffer, preferred_size, "%lu",
+					(unsigned long) host_ticks));
+}
+static void *notifier(void *arg) {
+	while (!stop) {
+		coap_notify_observers(&res_stress);
+		__sync_fetch_and_add(&notifies, 1);
+	}
+	return NULL;
+}
+static void observe(ip_addr_t *addr, uint16_t port, uint8_t token) {
+	uint8_t raw[] = { 0x42, 0x01, 0x00, 0x01, 0xAA, token, 0x60, 0x56, 's',
+			't', 'r', 'e', 's', 's' };
+	coap_packet_t request[1];
+	coap_packet_t response[1];
+
+	coap_parse_message(request, raw, sizeof(raw));
+	request->addr = *addr;
+	request->port = port;
+	coap_init_message(response, COAP_TYPE_ACK, CONTENT_2_05, 1);
+	coap_observe_handler(&res_stress, request, response);
+}
+/*---------------------------------------------------------------------------*/
+int main(void) {
+	pthread_t threads[NOTIFIERS];
+	unsigned long registered = 0, removed = 0, acked = 0;
+	uint32_t seed = 1;
+	long i;
+	int t;
+
+	coap_init_connection(COAP_SERVER_PORT);
+	res_stress.url = "stress";
+	for (t = 0; t < NOTIFIERS; ++t) {
+		pthread_create(&threads[t], NULL, notifier, NULL);
+	}
+
+	for (i = 0; i < ITERATIONS; ++i) {
+		uint32_t r;
+		ip_addr_t addr;
+		uint16_t port;
+		uint8_t token;
+
+		seed = seed * 1103515245 + 12345;
+		r = seed >> 8;
+		addr.addr = 1 + r % CLIENTS;
+		port = 1000 + (r >> 4) % 2;
+		token = (uint8_t) r;
+
+		switch ((r >> 8) % 6) {
+		case 0:
+		case 1:
+			observe(&addr, port, token);
+			++registered;
+			break;
+		case 2:
+			removed += coap_remove_observer_by_client(&addr, port);
+			break;
+		case 3: {
+			uint8_t tk[2] = { 0xAA, token };
+
+			removed += coap_remove_observer_by_token(&addr, port, tk, 2);
+			break;
+		}
+		case 4: {
+			uint16_t mid;
+
+			host_enter_critical();
+			mid = host_last_sent[2] << 8 | host_last_sent[3];
+			host_exit_critical();
+			acked += coap_observe_acknowledged(&addr, port, mid);
+			removed += coap_remove_observer_by_mid(&addr, port,
+					(uint16_t) (r >> 3));
+			break;
+		}
+		default:
+			host_ticks += 500;
+			coap_timer_run(0);
+			break;
+		}
+	}
+
+	stop = 1;
+	for (t = 0; t < NOTIFIERS; ++t) {
+		pthread_join(threads[t], NULL);
+	}
+	coap_remove_observer_by_uri(NULL, 0, "stress");
+	if (res_stress.observers != NULL) {
+		fail("observers left after removing all");
+	}
+
+	printf("registered %lu removed %lu acked %lu notifies %lu\n", registered,
+			removed, acked, notifies);
+	puts("ok");
+	return 0;
+}
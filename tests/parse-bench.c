@@ -0,0 +1,71 @@
+/*
+ * Parse throughput of typical requests. Build it against two revisions of
+ * the parser to compare them; the figures only mean something relative to
+ * each other on the same host.
+ *
+ * Build and run from the repository root:
+ *
+ *   cc -std=gnu99 -fcommon -O2 -pthread -Itests/host -I. \
+ *     -DREST=coap_rest_implementation tests/parse-bench.c tests/host/host.c \
+ *     *.c -o parse-bench && ./parse-bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "er-coap.h"
+
+#define ROUNDS 2000000
+
+static const struct {
+	const char *name;
+	uint8_t data[64];
+	uint16_t len;
+} samples[] = {
+	{ "GET /a", { 0x40, 0x01, 0x12, 0x34, 0xB1, 'a' }, 6 },
+	{ "GET /sensors/temp?unit=c, token, observe",
+		{ 0x42, 0x01, 0x12, 0x34, 0xAB, 0xCD, 0x60, 0x57, 's', 'e', 'n', 's',
+			'o', 'r', 's', 0x04, 't', 'e', 'm', 'p', 0x46, 'u', 'n', 'i',
+			't', '=', 'c' }, 27 },
+	{ "PUT /cfg, block1, payload",
+		{ 0x41, 0x03, 0x12, 0x34, 0xAA, 0xB3, 'c', 'f', 'g', 0x11, 0x2A, 0xD1,
+			0x02, 0x0E, 0xFF, '{', '"', 'v', '"', ':', '1', '}' }, 22 },
+};
+
+/*---------------------------------------------------------------------------*/
+/* returns ns per round, reading the Uri-Path back if asked to */
+static double run(unsigned int sample, int read_path) {
+	uint8_t datagram[64];
+	coap_packet_t packet[1];
+	const char *path;
+	struct timespec start, end;
+	long r;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < ROUNDS; ++r) {
+		/* merging repeated options writes into the datagram */
+		memcpy(datagram, samples[sample].data, samples[sample].len);
+		if (coap_parse_message(packet, datagram, samples[sample].len)
+				!= NO_ERROR) {
+			fprintf(stderr, "%s: parse failed\n", samples[sample].name);
+			exit(1);
+		}
+		if (read_path) {
+			coap_get_header_uri_path(packet, &path);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec))
+			/ ROUNDS;
+}
+int main(void) {
+	unsigned int i;
+
+	printf("%-42s %12s %12s\n", "", "parse", "+ uri-path");
+	for (i = 0; i < sizeof(samples) / sizeof(samples[0]); ++i) {
+		printf("%-42s %9.1f ns %9.1f ns\n", samples[i].name, run(i, 0),
+				run(i, 1));
+	}
+	return 0;
+}
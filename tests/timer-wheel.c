@@ -0,0 +1,75 @@
+/*
+ * Host-side test for the timing wheel: timers fire in the run at or after
+ * their deadline and never before, including deadlines exactly on a slot
+ * boundary.
+ *
+ * Build and run from the repository root:
+ *
+ *   cc -std=gnu99 -fcommon -g -fsanitize=address,undefined -pthread \
+ *     -Itests/host -I. -DREST=coap_rest_implementation \
+ *     tests/timer-wheel.c tests/host/host.c *.c \
+ *     -o timer-wheel && ./timer-wheel
+ */
+#include <stdio.h>
+#include "er-coap-timer.h"
+
+#define TICKS pdMS_TO_TICKS(COAP_TIMER_GRANULARITY_MS)
+
+static TickType_t fired_at;
+static int fired;
+
+/*---------------------------------------------------------------------------*/
+static void expired(void *data) {
+	fired_at = host_ticks;
+	++fired;
+}
+/* arms a timer at start and runs the wheel whenever it asks to be called */
+static int check(TickType_t start, TickType_t delay) {
+	coap_timer_t timer;
+	TickType_t deadline = start + delay;
+	TickType_t wait;
+
+	host_ticks = start;
+	coap_timer_run(0);
+	coap_timer_init(&timer, expired, NULL);
+	coap_timer_set(&timer, 0, delay);
+	fired = 0;
+	wait = coap_timer_run(0);
+	while (!fired && wait != portMAX_DELAY) {
+		host_ticks += wait;
+		wait = coap_timer_run(0);
+	}
+	if (fired != 1 || COAP_TIMER_BEFORE(fired_at, deadline)
+			|| fired_at - deadline >= TICKS) {
+		printf("FAIL: armed at %lu for %lu, fired %d times at %lu\n",
+				(unsigned long) start, (unsigned long) delay, fired,
+				(unsigned long) fired_at);
+		return 1;
+	}
+	return 0;
+}
+/*---------------------------------------------------------------------------*/
+int main(void) {
+	int failed = 0;
+	TickType_t start;
+	TickType_t delay;
+
+	/* deadlines on a slot boundary, armed from within a slot and on one */
+	failed += check(TICKS / 2, TICKS - TICKS / 2);
+	failed += check(3 * TICKS, TICKS);
+	failed += check(3 * TICKS + 1, 4 * TICKS - 1);
+
+	for (start = 0; start < 2 * TICKS; start += 7) {
+		for (delay = 0; delay < 3 * TICKS; delay += 3) {
+			failed += check(10 * TICKS + start, delay);
+		}
+	}
+	/* the tick counter wraps */
+	failed += check((TickType_t) 0 - TICKS / 2, TICKS);
+
+	if (failed) {
+		return 1;
+	}
+	puts("ok");
+	return 0;
+}